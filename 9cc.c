@@ -1,37 +1,724 @@
 #include "9cc.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
-int main(int argc, char **argv)
+// options that apply to every program compiled by this process
+char **entries;
+int nentries;
+bool obj_output;
+bool stats_json;
+
+// source file compiled by the multi-file driver
+typedef struct SourceFile SourceFile;
+struct SourceFile
+{
+    char *path;
+    char *output;
+    int status;
+    double time; // wall time in seconds
+};
+
+SourceFile *sources;
+int nsources;
+atomic_int next_source;
+
+void usage()
+{
+    fprintf(stderr,
+            "usage: 9cc [-c | --run | --jit | --stream | --batch] [--dump-callgraph] [--entry=<name>]...\n"
+            "           [--cache=<dir>] [--stats[=json]] [--profile-generate=<file> | --profile-use=<file>]\n"
+            "           [-j <threads>] [-o <output>] <file | - | program>\n"
+            "       9cc [-c] [--entry=<name>]... [-j <threads>] [--time] <file> <file>...\n"
+            "\n"
+            "--stream compiles one function at a time, without call folding, inlining\n"
+            "or function layout. --cache=<dir> reuses the code of unchanged functions\n"
+            "and needs --stream, so that cached and uncached output are the same.\n");
+    exit(1);
+}
+
+// reads a stream that cannot be mapped, such as a pipe.
+char *read_stream(FILE *fp)
 {
-    if (argc != 2)
+    size_t cap = 4096;
+    size_t len = 0;
+    char *buf = malloc(cap);
+    for (;;)
     {
-        fprintf(stderr, "invalid args\n");
-        return 1;
+        len += fread(buf + len, 1, cap - len - 1, fp);
+        if (len < cap - 1)
+        {
+            break;
+        }
+        cap *= 2;
+        buf = realloc(buf, cap);
+    }
+    if (ferror(fp))
+    {
+        error("%s: read error", filename);
+    }
+    if (memchr(buf, '\0', len))
+    {
+        error("%s: null character in the source", filename);
+    }
+    buf[len] = '\0';
+    return buf;
+}
+
+// maps a source file read-only. the mapping is one page longer than
+// the file needs, so the input is always followed by zeros, which the
+// tokenizer takes as the end of the input.
+char *map_file(char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        error("cannot open %s: %s", path, strerror(errno));
     }
 
-    // tokenize and parse.
-    user_input = argv[1];
-    token = tokenize();
+    struct stat st;
+    if (fstat(fd, &st))
+    {
+        error("cannot stat %s: %s", path, strerror(errno));
+    }
+    if (!S_ISREG(st.st_mode))
+    {
+        FILE *fp = fdopen(fd, "r");
+        char *buf = read_stream(fp);
+        fclose(fp);
+        return buf;
+    }
+
+    size_t size = st.st_size;
+    long page = sysconf(_SC_PAGESIZE);
+    char *buf = mmap(NULL, (size / page + 1) * page, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED)
+    {
+        error("%s: mmap failed", path);
+    }
+    if (size && mmap(buf, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+        error("%s: mmap failed", path);
+    }
+    close(fd);
+
+    if (memchr(buf, '\0', size))
+    {
+        error("%s: null character in the source", path);
+    }
+    return buf;
+}
+
+// the program is read from stdin if the argument is "-", and from
+// the file it names if it exists or cannot be a program, which always
+// has a "(". otherwise the argument is the program itself.
+char *read_input(char *arg)
+{
+    struct stat st;
+    if (!strcmp(arg, "-"))
+    {
+        filename = "<stdin>";
+        return read_stream(stdin);
+    }
+    if (!strchr(arg, '(') || !stat(arg, &st))
+    {
+        filename = arg;
+        return map_file(arg);
+    }
+    return arg;
+}
+
+// lays out the local variables of a function on its stack frame
+void assign_lvar_offsets(Function *fn)
+{
+    int offset = 0;
+    for (VarList *vl = fn->locals; vl; vl = vl->next)
+    {
+        offset += 8;
+    }
+    int i = 0;
+    for (VarList *vl = fn->locals; vl; vl = vl->next)
+    {
+        vl->var->offset = offset - 8 * i;
+        i++;
+    }
+    if (offset % 16)
+    {
+        offset += 8;
+    }
+    fn->stack_size = offset;
+}
+
+// parses the tokens and runs the passes that precede code generation.
+Function *parse_program(Token *tokens)
+{
+    phase_begin(PH_PARSE);
+    token = tokens;
     Function *prog = program();
+    phase_end(PH_PARSE);
+
+    phase_begin(PH_LAYOUT);
+    for (Function *fn = prog; fn; fn = fn->next)
+    {
+        assign_lvar_offsets(fn);
+    }
+    phase_end(PH_LAYOUT);
+
+    phase_begin(PH_OPTIMIZE);
+    index_functions(prog);
+    fold_calls(prog);
+    inline_hot_calls(prog);
+
+    build_callgraph(prog);
+    mark_reachable(prog, entries, nentries);
+    phase_end(PH_OPTIMIZE);
+    return prog;
+}
+
+Token *tokenize_input()
+{
+    phase_begin(PH_TOKENIZE);
+    Token *tokens = tokenize();
+    phase_end(PH_TOKENIZE);
+    count_tokens(tokens);
+    return tokens;
+}
+
+void report_stats()
+{
+    if (stats_enabled)
+    {
+        print_stats(stderr, stats_json);
+    }
+}
+
+// generates the code of prog and records its statistics
+void generate(Function *prog, Backend *be, FILE *out)
+{
+    phase_begin(PH_CODEGEN);
+    codegen(prog, be, out);
+    phase_end(PH_CODEGEN);
+    count_functions(prog, be->counts_insns);
+}
+
+// compiles one program of a batch. an error is reported and makes
+// this return 1 instead of ending the whole batch.
+int compile_unit(char *src, FILE *out)
+{
+    jmp_buf *prev = error_jmp;
+    jmp_buf jmp;
+    if (setjmp(jmp))
+    {
+        error_jmp = prev;
+        return 1;
+    }
+    error_jmp = &jmp;
 
+    user_input = src;
+    Token *tokens = tokenize();
+    Function *prog = parse_program(tokens);
+
+    // layout_functions() unlinks unreachable functions,
+    // so remember all of them to release them later.
+    int n = 0;
+    for (Function *fn = prog; fn; fn = fn->next)
+    {
+        n++;
+    }
+    Function **funcs = calloc(n + 1, sizeof(Function *));
+    n = 0;
     for (Function *fn = prog; fn; fn = fn->next)
     {
-        int offset = 0;
-        for (VarList *vl = fn->locals; vl; vl = vl->next)
+        funcs[n++] = fn;
+    }
+
+    prog = layout_functions(prog, entries, nentries);
+    if (!obj_output)
+    {
+        a64_file_directive(out);
+    }
+    codegen(prog, obj_output ? &aarch64_obj_backend : &aarch64_backend, out);
+
+    for (int i = 0; i < n; i++)
+    {
+        free_function(funcs[i]);
+    }
+    free(funcs);
+    free_tokens(tokens);
+    error_jmp = prev;
+    return 0;
+}
+
+// compiles many programs in one process. the input holds programs
+// separated by NUL characters, as written by `printf '%s\0'` or
+// `find -print0`. the output of the n-th program goes to <dir>/<n>.s
+// (or .o) if dir is given, and otherwise to stdout, preceded by a
+// "<status> <length>\n" header. returns 1 if any program failed.
+int compile_batch(char *input, char *dir)
+{
+    FILE *in = strcmp(input, "-") ? fopen(input, "r") : stdin;
+    if (!in)
+    {
+        error("cannot open %s: %s", input, strerror(errno));
+    }
+    if (dir && mkdir(dir, 0777) && errno != EEXIST)
+    {
+        error("cannot create %s: %s", dir, strerror(errno));
+    }
+
+    // the source buffer is reused by every program
+    char *src = NULL;
+    size_t cap = 0;
+    char name[PATH_MAX];
+    int failed = 0;
+
+    for (int n = 0; getdelim(&src, &cap, '\0', in) != -1; n++)
+    {
+        // the programs are not files, so they are only named in errors
+        snprintf(name, sizeof(name), "%s[%d]", input, n);
+        input_label = name;
+
+        if (dir)
         {
-            offset += 8;
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%d.%s", dir, n, obj_output ? "o" : "s");
+            FILE *out = fopen(path, "w");
+            if (!out)
+            {
+                error("cannot open %s: %s", path, strerror(errno));
+            }
+            failed |= compile_unit(src, out);
+            fclose(out);
+            continue;
         }
-        int i = 0;
-        for (VarList *vl = fn->locals; vl; vl = vl->next)
+
+        char *buf;
+        size_t len;
+        FILE *out = open_memstream(&buf, &len);
+        int status = compile_unit(src, out);
+        fclose(out);
+        if (status)
         {
-            vl->var->offset = offset - 8 * i;
-            i++;
+            failed = 1;
+            len = 0;
         }
-        if (offset % 16)
+        printf("%d %zu\n", status, len);
+        fwrite(buf, 1, len, stdout);
+        free(buf);
+    }
+
+    input_label = NULL;
+    free(src);
+    if (in != stdin)
+    {
+        fclose(in);
+    }
+    return failed;
+}
+
+// foo.c is compiled to foo.s, or foo.o with -c
+char *output_path(char *path)
+{
+    char *dot = strrchr(path, '.');
+    char *slash = strrchr(path, '/');
+    int len = dot && (!slash || slash < dot) ? dot - path : strlen(path);
+    char *buf = malloc(len + 3);
+    sprintf(buf, "%.*s.%s", len, path, obj_output ? "o" : "s");
+    if (!strcmp(buf, path))
+    {
+        error("%s: output would overwrite the input", path);
+    }
+    return buf;
+}
+
+double elapsed(struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void compile_file(SourceFile *sf)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    jmp_buf jmp;
+    if (setjmp(jmp))
+    {
+        sf->status = 1;
+    }
+    else
+    {
+        error_jmp = &jmp;
+        filename = sf->path;
+        char *src = map_file(sf->path);
+        FILE *out = fopen(sf->output, "w");
+        if (!out)
+        {
+            error("cannot open %s: %s", sf->output, strerror(errno));
+        }
+        sf->status = compile_unit(src, out);
+        fclose(out);
+        if (sf->status)
+        {
+            remove(sf->output);
+        }
+    }
+    error_jmp = NULL;
+    sf->time = elapsed(&start);
+}
+
+void *driver_worker(void *arg)
+{
+    for (;;)
+    {
+        int i = atomic_fetch_add(&next_source, 1);
+        if (i >= nsources)
         {
-            offset += 8;
+            free_local_idents();
+            return NULL;
         }
-        fn->stack_size = offset;
+        compile_file(&sources[i]);
+    }
+}
+
+// compiles each source file to its own output on nthreads threads.
+// the files share nothing, so the outputs are the same as those of
+// compiling them one at a time. returns 1 if any file failed.
+int compile_files(int nthreads, bool timing)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < nsources; i++)
+    {
+        sources[i].output = output_path(sources[i].path);
+    }
+
+    if (nthreads > nsources)
+    {
+        nthreads = nsources;
+    }
+    atomic_init(&next_source, 0);
+    if (nthreads <= 1)
+    {
+        driver_worker(NULL);
+    }
+    else
+    {
+        pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+        for (int i = 0; i < nthreads; i++)
+        {
+            if (pthread_create(&threads[i], NULL, driver_worker, NULL))
+            {
+                error("cannot create thread");
+            }
+        }
+        for (int i = 0; i < nthreads; i++)
+        {
+            pthread_join(threads[i], NULL);
+        }
+        free(threads);
+    }
+
+    int failed = 0;
+    for (int i = 0; i < nsources; i++)
+    {
+        failed |= sources[i].status;
+        if (timing)
+        {
+            fprintf(stderr, "%s: %.3f ms%s\n", sources[i].path, sources[i].time * 1e3,
+                    sources[i].status ? " (failed)" : "");
+        }
+    }
+    if (timing)
+    {
+        fprintf(stderr, "total: %d files, %.3f ms, %d threads\n", nsources, elapsed(&start) * 1e3, nthreads);
+    }
+    return failed;
+}
+
+// compiles one function at a time, releasing its tokens and AST once
+// its assembly is written, so memory use is bounded by the largest
+// function instead of the whole input. passes that need the whole
+// program, such as call folding and the call graph, are skipped.
+//
+// since each function is compiled on its own, the code of a function
+// whose tokens have not changed can be taken from the cache without
+// parsing it.
+void compile_stream(char *p)
+{
+    a64_file_directive(stdout);
+    for (;;)
+    {
+        phase_begin(PH_TOKENIZE);
+        token = tokenize_function(p, &p);
+        phase_end(PH_TOKENIZE);
+        Token *tokens = token;
+        count_tokens(tokens);
+        if (at_eof())
+        {
+            free_tokens(tokens);
+            return;
+        }
+
+        unsigned long key = 0;
+        if (cache_dir)
+        {
+            key = hash_function(tokens);
+            int len;
+            char *code = cache_read(key, &len, tokens);
+            if (code)
+            {
+                // written by the backend like generated code, so
+                // that it gets the same directives around it
+                count_cache_hit();
+                Function cached = {.code = code, .code_len = len};
+                aarch64_backend.end(&cached, stdout);
+                free(code);
+                free_tokens(tokens);
+                continue;
+            }
+        }
+
+        phase_begin(PH_PARSE);
+        Function *fn = function();
+        phase_end(PH_PARSE);
+
+        phase_begin(PH_LAYOUT);
+        assign_lvar_offsets(fn);
+        phase_end(PH_LAYOUT);
+
+        generate(fn, &aarch64_backend, stdout);
+        fflush(stdout);
+        if (cache_dir)
+        {
+            cache_write(key, fn->code, fn->code_len, tokens);
+        }
+
+        free_function(fn);
+        free_tokens(tokens);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    char *input = NULL;
+    char *output = NULL;
+    bool dump = false;
+    bool run = false;
+    bool jit = false;
+    bool stream = false;
+    bool batch = false;
+    bool timing = false;
+    entries = calloc(argc, sizeof(char *));
+    sources = calloc(argc, sizeof(SourceFile));
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--dump-callgraph"))
+        {
+            dump = true;
+            continue;
+        }
+        if (!strcmp(argv[i], "--run"))
+        {
+            run = true;
+            continue;
+        }
+        if (!strcmp(argv[i], "-c"))
+        {
+            obj_output = true;
+            continue;
+        }
+        if (!strcmp(argv[i], "--stats") || !strcmp(argv[i], "--stats=json"))
+        {
+            stats_enabled = true;
+            stats_json = argv[i][7] == '=';
+            continue;
+        }
+        if (!strcmp(argv[i], "--time"))
+        {
+            timing = true;
+            continue;
+        }
+        if (!strcmp(argv[i], "--batch"))
+        {
+            batch = true;
+            continue;
+        }
+        if (!strcmp(argv[i], "--stream"))
+        {
+            stream = true;
+            continue;
+        }
+        if (!strcmp(argv[i], "--jit"))
+        {
+            jit = true;
+            continue;
+        }
+        if (!strcmp(argv[i], "-o"))
+        {
+            if (++i == argc)
+            {
+                usage();
+            }
+            output = argv[i];
+            continue;
+        }
+        if (!strncmp(argv[i], "-o", 2))
+        {
+            output = argv[i] + 2;
+            continue;
+        }
+        if (!strcmp(argv[i], "-j"))
+        {
+            if (++i == argc)
+            {
+                usage();
+            }
+            codegen_threads = atoi(argv[i]);
+            continue;
+        }
+        if (!strncmp(argv[i], "-j", 2))
+        {
+            codegen_threads = atoi(argv[i] + 2);
+            continue;
+        }
+        if (!strncmp(argv[i], "--cache=", 8))
+        {
+            cache_init(argv[i] + 8);
+            continue;
+        }
+        if (!strncmp(argv[i], "--entry=", 8))
+        {
+            entries[nentries++] = argv[i] + 8;
+            continue;
+        }
+        if (!strncmp(argv[i], "--profile-generate=", 19))
+        {
+            profile_output = argv[i] + 19;
+            continue;
+        }
+        if (!strncmp(argv[i], "--profile-use=", 14))
+        {
+            profile_load(argv[i] + 14);
+            continue;
+        }
+        if (argv[i][0] == '-' && argv[i][1])
+        {
+            usage();
+        }
+        sources[nsources++].path = argv[i];
+    }
+
+    // the counters are only written by the assembly output, and cached
+    // code would not match the profile
+    if (profile_output && (profile_loaded || obj_output || run || jit || stream))
+    {
+        usage();
+    }
+    if (profile_loaded && cache_dir)
+    {
+        usage();
+    }
+    if (cache_dir && !stream)
+    {
+        usage();
+    }
+
+    if (nsources == 0)
+    {
+        usage();
+    }
+
+    // with several files, -j is the number of files compiled at once
+    if (nsources > 1)
+    {
+        if (run || jit || dump || stream || batch || output || stats_enabled)
+        {
+            usage();
+        }
+        int nthreads = codegen_threads;
+        codegen_threads = 1;
+        return compile_files(nthreads, timing);
+    }
+    input = sources[0].path;
+
+    // in batch mode, -o names the directory for the outputs
+    if (batch)
+    {
+        if (run || jit || dump || stream || stats_enabled)
+        {
+            usage();
+        }
+        return compile_batch(input, output);
+    }
+
+    user_input = read_input(input);
+
+    if (output && !freopen(output, "w", stdout))
+    {
+        error("cannot open %s: %s", output, strerror(errno));
+    }
+
+    if (stream)
+    {
+        if (run || jit || obj_output || dump || nentries)
+        {
+            usage();
+        }
+        compile_stream(user_input);
+        report_stats();
+        return 0;
+    }
+
+    // tokenize and parse.
+    Function *prog = parse_program(tokenize_input());
+
+    if (dump)
+    {
+        dump_callgraph(prog, stdout);
+        return 0;
+    }
+
+    // drop functions not reachable from the entry points
+    // and place callees next to their callers.
+    phase_begin(PH_OPTIMIZE);
+    prog = layout_functions(prog, entries, nentries);
+    phase_end(PH_OPTIMIZE);
+
+    // execute directly instead of emitting assembly
+    if (run)
+    {
+        count_functions(prog, false);
+        report_stats();
+        return run_program(prog);
+    }
+
+    // compile to x86-64 in memory and call main()
+    if (jit)
+    {
+        generate(prog, &x86_64_jit_backend, stdout);
+        report_stats();
+        return jit_run();
+    }
+
+    // write an ELF object instead of assembly
+    if (obj_output)
+    {
+        generate(prog, &aarch64_obj_backend, stdout);
+        report_stats();
+        return 0;
     }
 
-    codegen(prog);
+    a64_file_directive(stdout);
+    generate(prog, &aarch64_backend, stdout);
+    report_stats();
 }
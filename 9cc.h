@@ -1,4 +1,7 @@
+#define _DEFAULT_SOURCE
 #include <ctype.h>
+#include <limits.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -25,25 +28,37 @@ struct Token
     TokenKind kind; // token types
     Token *next;
     int val;   // if kind == TK_NUM, this field represents the integer
+    int id;    // if kind == TK_IDENT, the interned identifier
     char *str; // token string
     int len;   // the length of token
+    int line;  // line number, from 1
+    int col;   // column, from 1
 };
 
+void error_exit();
 void error(char *fmt, ...);
 void error_at(char *loc, char *fmt, ...);
-char *strndup(char *p, int len);
 void error_tok(Token *tok, char *fmt, ...);
 Token *consume(char *op);
 Token *consume_ident();
 void expect(char *op);
 int expect_number();
-char *expect_ident();
+int expect_ident();
 bool at_eof();
 Token *new_token(TokenKind kind, Token *cur, char *str, int len);
 Token *tokenize();
+Token *tokenize_function(char *p, char **rest);
+void free_tokens(Token *tok);
+int intern(char *str, int len);
+int num_idents();
+char *ident_name(int id);
+void free_local_idents();
 
-extern char *user_input;
-extern Token *token;
+extern _Thread_local char *filename;
+extern _Thread_local char *input_label;
+extern _Thread_local char *user_input;
+extern _Thread_local Token *token;
+extern _Thread_local jmp_buf *error_jmp;
 
 //
 // parse.c
@@ -53,6 +68,7 @@ typedef struct Var Var;
 struct Var
 {
     char *name; // Variable name
+    int id;     // interned name
     int offset; // Offset from RBP
 };
 
@@ -112,6 +128,7 @@ struct Node
 
     // Function call
     char *funcname;
+    int funcid; // interned funcname
     Node *args;
 
     int val;  // use this components if kind == ND_NUM
@@ -119,21 +136,265 @@ struct Node
 };
 
 typedef struct Function Function;
+typedef struct CallEdge CallEdge;
+typedef struct CallSite CallSite;
+typedef struct Counter Counter;
+
 struct Function
 {
     Function *next;
     char *name;
+    int id;     // interned name
+    Token *tok; // function name
     VarList *params;
 
     Node *node;
     VarList *locals;
     int stack_size;
+
+    bool is_pure; // no side effects; calls may be evaluated at compile time
+
+    // call graph
+    CallEdge *callees;
+    bool reachable;
+    bool placed;
+
+    // output of code generation, joined by Backend.end
+    char *code;
+    int code_len;
+    CallSite *calls;
+    int insn_count; // number of instructions, if the backend counts them
+
+    // execution counters inserted by --profile-generate
+    Counter *counters;
+    int ncounters;
+};
+
+// call graph edge. one per distinct callee.
+struct CallEdge
+{
+    CallEdge *next;
+    char *name;   // callee name
+    int id;       // interned callee name
+    Function *fn; // callee definition, or NULL if defined elsewhere
+    int count;    // number of call sites
 };
 
 Function *program();
+Function *function();
+void free_node(Node *node);
+void free_function(Function *fn);
+
+//
+// fold.c
+//
+
+void index_functions(Function *prog);
+Function *find_func(int id);
+int count_params(Function *fn);
+int count_args(Node *node);
+void fold_calls(Function *prog);
+
+//
+// callgraph.c
+//
+
+void build_callgraph(Function *prog);
+void mark_reachable(Function *prog, char **entries, int nentries);
+Function *layout_functions(Function *prog, char **entries, int nentries);
+void dump_callgraph(Function *prog, FILE *out);
+
+//
+// interp.c
+//
+
+// host function callable from programs run by --run or --jit
+typedef struct Builtin Builtin;
+struct Builtin
+{
+    char *name;
+    int nargs;
+    long (*fn)(long *args);
+};
+
+extern Builtin builtins[];
+
+int find_builtin(char *name);
+int run_program(Function *prog);
 
 //
 // codegen.c
 //
 
-void codegen(Function *prog);
+// kinds of the local labels of if, while and for statements
+typedef enum
+{
+    LB_ELSE,
+    LB_END,
+    LB_BEGIN,
+    LB_THEN,
+    LB_COND, // condition of a rotated loop
+    NUM_LABEL_KINDS,
+} LabelKind;
+
+// call instruction in the generated code of a function
+struct CallSite
+{
+    CallSite *next;
+    int offset; // offset in Function.code
+    char *name; // callee
+    int id;     // interned callee name
+};
+
+// operations of the stack machine that code generation targets.
+// every expression leaves its value on top of the stack.
+//
+// begin and end run on the main thread. everything from prologue to
+// epilogue may run on a worker thread, so it only touches thread-local
+// state and leaves its output in the Function.
+typedef struct Backend Backend;
+struct Backend
+{
+    void (*begin)(Function *prog);
+    void (*end)(Function *prog, FILE *out);
+    void (*prologue)(Function *fn);
+    void (*epilogue)(Function *fn);
+
+    void (*push_imm)(long val);
+    void (*push_var_addr)(Var *var);
+    void (*pop)();        // discard the top
+    void (*pop_result)(); // move the top to the return value register
+    void (*load)();       // replace an address with the value it points to
+    void (*store)();      // pop a value and an address, store, push the value
+    void (*binop)(NodeKind kind);
+    void (*funcall)(int id, int nargs);
+    void (*ret)(); // pop the return value and leave the function
+
+    void (*branch_zero)(LabelKind kind, int seq);    // pop and branch if zero
+    void (*branch_nonzero)(LabelKind kind, int seq); // pop and branch if not zero
+    void (*jump)(LabelKind kind, int seq);
+    void (*label)(LabelKind kind, int seq);
+
+    // optional. called before the code of each node with its token,
+    // so that the backend can map instructions to source lines.
+    void (*loc)(Token *tok);
+
+    // optional. adds one to counter `index` of the function, as
+    // inserted by --profile-generate.
+    void (*counter)(int index);
+
+    bool counts_insns; // sets Function.insn_count
+};
+
+extern int codegen_threads;
+
+void codegen(Function *prog, Backend *be, FILE *out);
+
+//
+// aarch64.c
+//
+
+extern Backend aarch64_backend;
+extern Backend aarch64_obj_backend;
+
+void a64_file_directive(FILE *out);
+
+//
+// elf.c
+//
+
+typedef struct ObjSym ObjSym;
+struct ObjSym
+{
+    ObjSym *next;
+    char *name;
+    int id;       // interned name
+    bool defined; // false for symbols of other files
+    int offset;   // offset in .text
+    int size;
+    int index;    // index in .symtab, set by write_elf()
+};
+
+typedef struct ObjReloc ObjReloc;
+struct ObjReloc
+{
+    ObjReloc *next;
+    int offset; // offset in .text
+    ObjSym *sym;
+    int type;
+};
+
+void write_elf(FILE *out, unsigned char *text, int text_len, ObjSym *syms, ObjReloc *relocs);
+
+//
+// cache.c
+//
+
+extern char *cache_dir;
+
+void cache_init(char *dir);
+unsigned long hash_function(Token *tok);
+char *cache_read(unsigned long key, int *len, Token *tok);
+void cache_write(unsigned long key, char *code, int len, Token *tok);
+
+//
+// profile.c
+//
+
+// places where --profile-generate counts executions
+typedef enum
+{
+    PC_ENTRY, // function entry
+    PC_THEN,  // then branch of an if statement
+    PC_ELSE,  // else branch, or skipping the then branch
+    PC_LOOP,  // loop back-edge
+} CounterKind;
+
+struct Counter
+{
+    Counter *next;
+    CounterKind kind;
+    int seq;   // label number of the statement
+    int index; // position in the counters of the function
+};
+
+extern char *counter_names[];
+extern char *profile_output;
+extern bool profile_loaded;
+
+void profile_load(char *path);
+bool profile_prefers_else(Function *fn, int seq);
+bool profile_rotates_loop(Function *fn, int seq);
+void inline_hot_calls(Function *prog);
+Function *group_hot_functions(Function *prog);
+
+//
+// stats.c
+//
+
+typedef enum
+{
+    PH_TOKENIZE,
+    PH_PARSE,
+    PH_LAYOUT,   // stack layout
+    PH_OPTIMIZE, // call folding and the call graph
+    PH_CODEGEN,
+    NUM_PHASES,
+} Phase;
+
+extern bool stats_enabled;
+
+void phase_begin(Phase ph);
+void phase_end(Phase ph);
+void count_tokens(Token *tok);
+void count_functions(Function *prog, bool insns);
+void count_cache_hit();
+void print_stats(FILE *out, bool json);
+
+//
+// x86_64.c
+//
+
+extern Backend x86_64_jit_backend;
+
+long jit_run();
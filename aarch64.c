@@ -0,0 +1,1049 @@
+#include "9cc.h"
+#include <elf.h>
+
+// AArch64 backend.
+//
+// The stack machine stack is the hardware stack. Each slot takes
+// 16 bytes so that sp stays 16-byte aligned as the ABI requires.
+//
+// Instruction selection produces A64Insn records, which are either
+// printed as assembly or encoded into an ELF relocatable object.
+//
+// Assembly also carries symbol types and sizes, CFI so that profilers
+// and debuggers can unwind through the generated functions, and line
+// info when the input is a file.
+
+// register numbers. 31 is sp or xzr depending on the instruction.
+#define X0 0
+#define X1 1
+#define X16 16
+#define X17 17
+#define FP 29
+#define LR 30
+#define SP 31
+
+// label of the function epilogue
+#define LABEL_RETURN -1
+
+typedef enum
+{
+    A64_MOV_IMM,  // mov rd, imm (movz or movn)
+    A64_MOVZ,     // movz rd, imm, lsl shift
+    A64_MOVK,     // movk rd, imm, lsl shift
+    A64_ADD_IMM,  // add rd, rn, imm, lsl shift
+    A64_SUB_IMM,  // sub rd, rn, imm, lsl shift
+    A64_ADD,      // add rd, rn, rm
+    A64_SUB,      // sub rd, rn, rm
+    A64_MUL,      // mul rd, rn, rm
+    A64_SDIV,     // sdiv rd, rn, rm
+    A64_CMP,      // cmp rn, rm
+    A64_CSET,     // cset rd, cond
+    A64_LDR,      // ldr rd, [rn, imm]
+    A64_STR,      // str rd, [rn, imm]
+    A64_LDR_POST, // ldr rd, [rn], imm
+    A64_STR_PRE,  // str rd, [rn, imm]!
+    A64_LDP_POST, // ldp rd, rm, [rn], imm
+    A64_STP_PRE,  // stp rd, rm, [rn, imm]!
+    A64_B,        // b label
+    A64_CBZ,      // cbz rd, label
+    A64_CBNZ,     // cbnz rd, label
+    A64_BL,       // bl sym
+    A64_RET,      // ret
+    A64_LABEL,    // label:
+} A64Op;
+
+// condition codes as encoded in the instruction
+typedef enum
+{
+    COND_EQ = 0,
+    COND_NE = 1,
+    COND_LT = 11,
+    COND_LE = 13,
+} A64Cond;
+
+typedef struct A64Insn A64Insn;
+struct A64Insn
+{
+    A64Op op;
+    int rd;
+    int rn;
+    int rm;
+    long imm;
+    int shift;
+    A64Cond cond;
+    int label;
+    int sym; // interned callee name
+};
+
+typedef struct A64Fixup A64Fixup;
+struct A64Fixup
+{
+    A64Fixup *next;
+    int pos;   // offset of the branch in the function
+    int label; // branch target
+};
+
+char *label_names[] = {"else", "end", "begin", "then", "cond"};
+
+// state of the function being generated
+_Thread_local bool a64_obj;
+_Thread_local char *funcname;
+_Thread_local int a64_ninsns;
+_Thread_local int a64_line; // line of the last .loc
+_Thread_local FILE *a64_out;
+_Thread_local char *a64_buf;
+_Thread_local size_t a64_buflen;
+
+_Thread_local unsigned char *obj_text;
+_Thread_local int obj_len;
+_Thread_local int obj_cap;
+_Thread_local CallSite *obj_calls;
+_Thread_local A64Fixup *obj_branches;
+_Thread_local int *obj_labels;
+_Thread_local int obj_nlabels;
+_Thread_local int obj_return;
+
+// object output state
+_Thread_local ObjSym *obj_syms;
+_Thread_local ObjSym *obj_syms_last;
+_Thread_local ObjSym **obj_sym_table; // indexed by interned name
+_Thread_local ObjReloc *obj_relocs;
+
+char *reg_name(int r)
+{
+    static char *names[] = {
+        "x0", "x1", "x2", "x3", "x4", "x5", "x6", "x7",
+        "x8", "x9", "x10", "x11", "x12", "x13", "x14", "x15",
+        "x16", "x17", "x18", "x19", "x20", "x21", "x22", "x23",
+        "x24", "x25", "x26", "x27", "x28", "x29", "x30", "sp"};
+    return names[r];
+}
+
+char *cond_name(A64Cond cond)
+{
+    switch (cond)
+    {
+    case COND_EQ:
+        return "eq";
+    case COND_NE:
+        return "ne";
+    case COND_LT:
+        return "lt";
+    case COND_LE:
+        return "le";
+    }
+    return NULL;
+}
+
+void print_label(int label)
+{
+    if (label == LABEL_RETURN)
+    {
+        fprintf(a64_out, ".Lreturn.%s", funcname);
+    }
+    else
+    {
+        fprintf(a64_out, ".L%s.%s.%d", label_names[label % NUM_LABEL_KINDS], funcname, label / NUM_LABEL_KINDS);
+    }
+}
+
+void print_mem(A64Insn *insn)
+{
+    if (insn->imm)
+    {
+        fprintf(a64_out, "[%s, %ld]", reg_name(insn->rn), insn->imm);
+    }
+    else
+    {
+        fprintf(a64_out, "[%s]", reg_name(insn->rn));
+    }
+}
+
+void print_insn(A64Insn *insn)
+{
+    if (insn->op == A64_LABEL)
+    {
+        print_label(insn->label);
+        fprintf(a64_out, ":\n");
+        return;
+    }
+
+    fprintf(a64_out, "    ");
+    switch (insn->op)
+    {
+    case A64_MOV_IMM:
+        fprintf(a64_out, "mov %s, %ld", reg_name(insn->rd), insn->imm);
+        break;
+    case A64_MOVZ:
+    case A64_MOVK:
+        fprintf(a64_out, "%s %s, %ld", insn->op == A64_MOVZ ? "movz" : "movk", reg_name(insn->rd), insn->imm);
+        if (insn->shift)
+        {
+            fprintf(a64_out, ", lsl %d", insn->shift);
+        }
+        break;
+    case A64_ADD_IMM:
+    case A64_SUB_IMM:
+        if (insn->op == A64_ADD_IMM && insn->imm == 0 && (insn->rd == SP || insn->rn == SP))
+        {
+            fprintf(a64_out, "mov %s, %s", reg_name(insn->rd), reg_name(insn->rn));
+            break;
+        }
+        fprintf(a64_out, "%s %s, %s, %ld", insn->op == A64_ADD_IMM ? "add" : "sub",
+               reg_name(insn->rd), reg_name(insn->rn), insn->imm);
+        if (insn->shift)
+        {
+            fprintf(a64_out, ", lsl %d", insn->shift);
+        }
+        break;
+    case A64_ADD:
+        fprintf(a64_out, "add %s, %s, %s", reg_name(insn->rd), reg_name(insn->rn), reg_name(insn->rm));
+        break;
+    case A64_SUB:
+        fprintf(a64_out, "sub %s, %s, %s", reg_name(insn->rd), reg_name(insn->rn), reg_name(insn->rm));
+        break;
+    case A64_MUL:
+        fprintf(a64_out, "mul %s, %s, %s", reg_name(insn->rd), reg_name(insn->rn), reg_name(insn->rm));
+        break;
+    case A64_SDIV:
+        fprintf(a64_out, "sdiv %s, %s, %s", reg_name(insn->rd), reg_name(insn->rn), reg_name(insn->rm));
+        break;
+    case A64_CMP:
+        fprintf(a64_out, "cmp %s, %s", reg_name(insn->rn), reg_name(insn->rm));
+        break;
+    case A64_CSET:
+        fprintf(a64_out, "cset %s, %s", reg_name(insn->rd), cond_name(insn->cond));
+        break;
+    case A64_LDR:
+    case A64_STR:
+        fprintf(a64_out, "%s %s, ", insn->op == A64_LDR ? "ldr" : "str", reg_name(insn->rd));
+        print_mem(insn);
+        break;
+    case A64_LDR_POST:
+        fprintf(a64_out, "ldr %s, [%s], %ld", reg_name(insn->rd), reg_name(insn->rn), insn->imm);
+        break;
+    case A64_STR_PRE:
+        fprintf(a64_out, "str %s, [%s, %ld]!", reg_name(insn->rd), reg_name(insn->rn), insn->imm);
+        break;
+    case A64_LDP_POST:
+        fprintf(a64_out, "ldp %s, %s, [%s], %ld", reg_name(insn->rd), reg_name(insn->rm), reg_name(insn->rn), insn->imm);
+        break;
+    case A64_STP_PRE:
+        fprintf(a64_out, "stp %s, %s, [%s, %ld]!", reg_name(insn->rd), reg_name(insn->rm), reg_name(insn->rn), insn->imm);
+        break;
+    case A64_B:
+        fprintf(a64_out, "b ");
+        print_label(insn->label);
+        break;
+    case A64_CBZ:
+    case A64_CBNZ:
+        fprintf(a64_out, "%s %s, ", insn->op == A64_CBZ ? "cbz" : "cbnz", reg_name(insn->rd));
+        print_label(insn->label);
+        break;
+    case A64_BL:
+        fprintf(a64_out, "bl %s", ident_name(insn->sym));
+        break;
+    case A64_RET:
+        fprintf(a64_out, "ret");
+        break;
+    }
+    fprintf(a64_out, "\n");
+}
+
+void obj_emit32(unsigned int word)
+{
+    if (obj_cap < obj_len + 4)
+    {
+        obj_cap = obj_cap ? obj_cap * 2 : 4096;
+        obj_text = realloc(obj_text, obj_cap);
+    }
+    memcpy(obj_text + obj_len, &word, 4);
+    obj_len += 4;
+}
+
+void add_branch_fixup(int label)
+{
+    A64Fixup *fx = calloc(1, sizeof(A64Fixup));
+    fx->pos = obj_len;
+    fx->label = label;
+    fx->next = obj_branches;
+    obj_branches = fx;
+}
+
+void add_call_site(int id)
+{
+    CallSite *cs = calloc(1, sizeof(CallSite));
+    cs->offset = obj_len;
+    cs->id = id;
+    cs->name = ident_name(id);
+    cs->next = obj_calls;
+    obj_calls = cs;
+}
+
+int obj_label_index(int label)
+{
+    if (obj_nlabels <= label)
+    {
+        int n = (label + 1) * 2;
+        obj_labels = realloc(obj_labels, n * sizeof(int));
+        for (int i = obj_nlabels; i < n; i++)
+        {
+            obj_labels[i] = -1;
+        }
+        obj_nlabels = n;
+    }
+    return label;
+}
+
+unsigned int enc_simm(long imm, int bits, char *what)
+{
+    if (imm < -(1L << (bits - 1)) || (1L << (bits - 1)) <= imm)
+    {
+        error("%s: offset %ld out of range", what, imm);
+    }
+    return imm & ((1L << bits) - 1);
+}
+
+unsigned int enc_mem(unsigned int scaled, unsigned int unscaled, A64Insn *insn)
+{
+    // ldr/str [rn, imm]: scaled unsigned offset if possible,
+    // otherwise the unscaled signed form (ldur/stur).
+    if (0 <= insn->imm && insn->imm % 8 == 0 && insn->imm / 8 < 4096)
+    {
+        return scaled | (insn->imm / 8) << 10 | insn->rn << 5 | insn->rd;
+    }
+    return unscaled | enc_simm(insn->imm, 9, "ldur/stur") << 12 | insn->rn << 5 | insn->rd;
+}
+
+void encode_insn(A64Insn *insn)
+{
+    int rd = insn->rd;
+    int rn = insn->rn;
+    int rm = insn->rm;
+
+    switch (insn->op)
+    {
+    case A64_MOV_IMM:
+        if (insn->imm >= 0)
+            obj_emit32(0xd2800000 | (insn->imm & 0xffff) << 5 | rd); // movz
+        else
+            obj_emit32(0x92800000 | (~insn->imm & 0xffff) << 5 | rd); // movn
+        return;
+    case A64_MOVZ:
+        obj_emit32(0xd2800000 | (insn->shift / 16) << 21 | (insn->imm & 0xffff) << 5 | rd);
+        return;
+    case A64_MOVK:
+        obj_emit32(0xf2800000 | (insn->shift / 16) << 21 | (insn->imm & 0xffff) << 5 | rd);
+        return;
+    case A64_ADD_IMM:
+    case A64_SUB_IMM:
+        obj_emit32((insn->op == A64_ADD_IMM ? 0x91000000 : 0xd1000000) |
+                   (insn->shift ? 1 : 0) << 22 | (insn->imm & 0xfff) << 10 | rn << 5 | rd);
+        return;
+    case A64_ADD:
+        obj_emit32(0x8b000000 | rm << 16 | rn << 5 | rd);
+        return;
+    case A64_SUB:
+        obj_emit32(0xcb000000 | rm << 16 | rn << 5 | rd);
+        return;
+    case A64_MUL:
+        obj_emit32(0x9b007c00 | rm << 16 | rn << 5 | rd); // madd rd, rn, rm, xzr
+        return;
+    case A64_SDIV:
+        obj_emit32(0x9ac00c00 | rm << 16 | rn << 5 | rd);
+        return;
+    case A64_CMP:
+        obj_emit32(0xeb00001f | rm << 16 | rn << 5); // subs xzr, rn, rm
+        return;
+    case A64_CSET:
+        obj_emit32(0x9a9f07e0 | (insn->cond ^ 1) << 12 | rd); // csinc rd, xzr, xzr, !cond
+        return;
+    case A64_LDR:
+        obj_emit32(enc_mem(0xf9400000, 0xf8400000, insn));
+        return;
+    case A64_STR:
+        obj_emit32(enc_mem(0xf9000000, 0xf8000000, insn));
+        return;
+    case A64_LDR_POST:
+        obj_emit32(0xf8400400 | enc_simm(insn->imm, 9, "ldr") << 12 | rn << 5 | rd);
+        return;
+    case A64_STR_PRE:
+        obj_emit32(0xf8000c00 | enc_simm(insn->imm, 9, "str") << 12 | rn << 5 | rd);
+        return;
+    case A64_LDP_POST:
+        obj_emit32(0xa8c00000 | enc_simm(insn->imm / 8, 7, "ldp") << 15 | rm << 10 | rn << 5 | rd);
+        return;
+    case A64_STP_PRE:
+        obj_emit32(0xa9800000 | enc_simm(insn->imm / 8, 7, "stp") << 15 | rm << 10 | rn << 5 | rd);
+        return;
+    case A64_B:
+        add_branch_fixup(insn->label);
+        obj_emit32(0x14000000);
+        return;
+    case A64_CBZ:
+        add_branch_fixup(insn->label);
+        obj_emit32(0xb4000000 | rd);
+        return;
+    case A64_CBNZ:
+        add_branch_fixup(insn->label);
+        obj_emit32(0xb5000000 | rd);
+        return;
+    case A64_BL:
+        add_call_site(insn->sym);
+        obj_emit32(0x94000000);
+        return;
+    case A64_RET:
+        obj_emit32(0xd65f03c0);
+        return;
+    case A64_LABEL:
+        if (insn->label == LABEL_RETURN)
+        {
+            obj_return = obj_len;
+        }
+        else
+        {
+            int idx = obj_label_index(insn->label);
+            obj_labels[idx] = obj_len;
+        }
+        return;
+    }
+}
+
+void emit(A64Insn insn)
+{
+    if (insn.op != A64_LABEL)
+    {
+        a64_ninsns++;
+    }
+
+    if (a64_obj)
+    {
+        encode_insn(&insn);
+    }
+    else
+    {
+        print_insn(&insn);
+    }
+}
+
+// prints an assembler directive. objects have no debug or unwind
+// sections, so they leave directives out.
+void emit_directive(char *fmt, ...)
+{
+    if (a64_obj)
+    {
+        return;
+    }
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(a64_out, "    ");
+    vfprintf(a64_out, fmt, ap);
+    fprintf(a64_out, "\n");
+    va_end(ap);
+}
+
+// adds one to counter index of the function. the counters live in
+// .bss, which objects do not have, so this is for assembly only.
+void a64_counter(int index)
+{
+    fprintf(a64_out, "    adrp x16, .Lprof.%s+%d\n", funcname, index * 8);
+    fprintf(a64_out, "    add x16, x16, :lo12:.Lprof.%s+%d\n", funcname, index * 8);
+    a64_ninsns += 2;
+    emit((A64Insn){A64_LDR, .rd = X17, .rn = X16});
+    emit((A64Insn){A64_ADD_IMM, .rd = X17, .rn = X17, .imm = 1});
+    emit((A64Insn){A64_STR, .rd = X17, .rn = X16});
+}
+
+// maps the following instructions to the line of tok. only the first
+// node on a line starts a new row of the line table.
+void a64_loc(Token *tok)
+{
+    if (a64_obj || !filename || tok->line == a64_line)
+    {
+        return;
+    }
+    a64_line = tok->line;
+    fprintf(a64_out, "    .loc 1 %d %d\n", tok->line, tok->col);
+}
+
+// rd = rn +/- imm. immediates are 12 bits, optionally shifted
+// left by 12, so larger ones take two instructions.
+void emit_add_imm(A64Op op, int rd, int rn, long imm)
+{
+    if (imm < 4096)
+    {
+        emit((A64Insn){op, .rd = rd, .rn = rn, .imm = imm});
+        return;
+    }
+    if (imm >= 1 << 24)
+    {
+        error("immediate %ld out of range", imm);
+    }
+    emit((A64Insn){op, .rd = rd, .rn = rn, .imm = imm >> 12, .shift = 12});
+    if (imm & 0xfff)
+    {
+        emit((A64Insn){op, .rd = rd, .rn = rd, .imm = imm & 0xfff});
+    }
+}
+
+void emit_push(int r)
+{
+    emit((A64Insn){A64_STR_PRE, .rd = r, .rn = SP, .imm = -16});
+}
+
+void emit_pop(int r)
+{
+    emit((A64Insn){A64_LDR_POST, .rd = r, .rn = SP, .imm = 16});
+}
+
+void a64_begin(Function *prog)
+{
+}
+
+void print_quoted(FILE *out, char *s)
+{
+    fputc('"', out);
+    for (char *p = s; *p; p++)
+    {
+        if (*p == '"' || *p == '\\')
+        {
+            fputc('\\', out);
+        }
+        fputc(*p, out);
+    }
+    fputc('"', out);
+}
+
+// names the input file for the .loc directives
+void a64_file_directive(FILE *out)
+{
+    if (!filename)
+    {
+        return;
+    }
+    fprintf(out, ".file 1 ");
+    print_quoted(out, filename);
+    fprintf(out, "\n");
+}
+
+// emits the function that appends the counters of --profile-generate
+// to the profile when the program exits. it is called through
+// .fini_array and walks a table of name and counter address pairs.
+void a64_profile_writer(Function *prog, FILE *out)
+{
+    fprintf(out, ".section .rodata\n");
+    fprintf(out, ".Lprof_path:\n    .string ");
+    print_quoted(out, profile_output);
+    fprintf(out, "\n");
+    fprintf(out, ".Lprof_mode:\n    .string \"a\"\n");
+    fprintf(out, ".Lprof_format:\n    .string \"%%s %%ld\\n\"\n");
+    int n = 0;
+    for (Function *fn = prog; fn; fn = fn->next)
+    {
+        for (Counter *c = fn->counters; c; c = c->next)
+        {
+            fprintf(out, ".Lprof_name%d:\n    .string \"%s %s %d\"\n", n++, fn->name, counter_names[c->kind], c->seq);
+        }
+    }
+
+    fprintf(out, ".data\n");
+    fprintf(out, "    .p2align 3\n");
+    fprintf(out, ".Lprof_table:\n");
+    n = 0;
+    for (Function *fn = prog; fn; fn = fn->next)
+    {
+        for (Counter *c = fn->counters; c; c = c->next)
+        {
+            fprintf(out, "    .xword .Lprof_name%d, .Lprof.%s+%d\n", n++, fn->name, c->index * 8);
+        }
+    }
+    fprintf(out, "    .xword 0, 0\n");
+
+    fprintf(out, ".section .fini_array, \"aw\"\n");
+    fprintf(out, "    .p2align 3\n");
+    fprintf(out, "    .xword __9cc_prof_write\n");
+
+    fprintf(out, ".text\n");
+    fprintf(out, ".type __9cc_prof_write, %%function\n");
+    fprintf(out, "__9cc_prof_write:\n");
+    fprintf(out, "    .cfi_startproc\n");
+    fprintf(out, "    stp x29, x30, [sp, -32]!\n");
+    fprintf(out, "    .cfi_def_cfa_offset 32\n");
+    fprintf(out, "    .cfi_offset 29, -32\n");
+    fprintf(out, "    .cfi_offset 30, -24\n");
+    fprintf(out, "    mov x29, sp\n");
+    fprintf(out, "    stp x19, x20, [sp, 16]\n");
+    fprintf(out, "    .cfi_offset 19, -16\n");
+    fprintf(out, "    .cfi_offset 20, -8\n");
+    fprintf(out, "    adrp x0, .Lprof_path\n");
+    fprintf(out, "    add x0, x0, :lo12:.Lprof_path\n");
+    fprintf(out, "    adrp x1, .Lprof_mode\n");
+    fprintf(out, "    add x1, x1, :lo12:.Lprof_mode\n");
+    fprintf(out, "    bl fopen\n");
+    fprintf(out, "    cbz x0, .Lprof_done\n");
+    fprintf(out, "    mov x19, x0\n");
+    fprintf(out, "    adrp x20, .Lprof_table\n");
+    fprintf(out, "    add x20, x20, :lo12:.Lprof_table\n");
+    fprintf(out, ".Lprof_loop:\n");
+    fprintf(out, "    ldr x2, [x20]\n");
+    fprintf(out, "    cbz x2, .Lprof_close\n");
+    fprintf(out, "    ldr x3, [x20, 8]\n");
+    fprintf(out, "    ldr x3, [x3]\n");
+    fprintf(out, "    mov x0, x19\n");
+    fprintf(out, "    adrp x1, .Lprof_format\n");
+    fprintf(out, "    add x1, x1, :lo12:.Lprof_format\n");
+    fprintf(out, "    bl fprintf\n");
+    fprintf(out, "    add x20, x20, 16\n");
+    fprintf(out, "    b .Lprof_loop\n");
+    fprintf(out, ".Lprof_close:\n");
+    fprintf(out, "    mov x0, x19\n");
+    fprintf(out, "    bl fclose\n");
+    fprintf(out, ".Lprof_done:\n");
+    fprintf(out, "    ldp x19, x20, [sp, 16]\n");
+    fprintf(out, "    ldp x29, x30, [sp], 32\n");
+    fprintf(out, "    .cfi_def_cfa 31, 0\n");
+    fprintf(out, "    ret\n");
+    fprintf(out, "    .cfi_endproc\n");
+    fprintf(out, ".size __9cc_prof_write, .-__9cc_prof_write\n");
+}
+
+// the driver emits the .file directive, once per output, since the
+// code of a stream comes from one call of this per function.
+void a64_end(Function *prog, FILE *out)
+{
+    bool counted = false;
+    for (Function *fn = prog; fn; fn = fn->next)
+    {
+        fwrite(fn->code, 1, fn->code_len, out);
+        counted |= fn->ncounters > 0;
+    }
+    if (counted)
+    {
+        a64_profile_writer(prog, out);
+    }
+}
+
+void a64_obj_begin(Function *prog)
+{
+    obj_syms = NULL;
+    obj_syms_last = NULL;
+    obj_relocs = NULL;
+}
+
+ObjSym *find_obj_sym(int id)
+{
+    return obj_sym_table[id];
+}
+
+ObjSym *add_obj_sym(int id, bool defined, int offset)
+{
+    ObjSym *sym = calloc(1, sizeof(ObjSym));
+    sym->id = id;
+    sym->name = ident_name(id);
+    sym->defined = defined;
+    sym->offset = offset;
+
+    // keep symbols in the order of their first appearance
+    if (obj_syms_last)
+    {
+        obj_syms_last->next = sym;
+    }
+    else
+    {
+        obj_syms = sym;
+    }
+    obj_syms_last = sym;
+
+    // like a search of the list, the first symbol of a name wins
+    if (!obj_sym_table[id])
+    {
+        obj_sym_table[id] = sym;
+    }
+    return sym;
+}
+
+// joins the code of the functions, resolves calls between them and
+// writes the object. calls to other files are left to the linker.
+void a64_obj_end(Function *prog, FILE *out)
+{
+    // every name is interned by now, so the table covers all the ids
+    obj_sym_table = calloc(num_idents() + 1, sizeof(ObjSym *));
+    int len = 0;
+    for (Function *fn = prog; fn; fn = fn->next)
+    {
+        ObjSym *sym = add_obj_sym(fn->id, true, len);
+        sym->size = fn->code_len;
+        len += fn->code_len;
+    }
+
+    unsigned char *text = calloc(len + 1, 1);
+    int pos = 0;
+    for (Function *fn = prog; fn; fn = fn->next)
+    {
+        memcpy(text + pos, fn->code, fn->code_len);
+
+        for (CallSite *cs = fn->calls; cs; cs = cs->next)
+        {
+            int offset = pos + cs->offset;
+            ObjSym *sym = find_obj_sym(cs->id);
+            if (sym && sym->defined)
+            {
+                unsigned int word;
+                memcpy(&word, text + offset, 4);
+                word |= enc_simm((sym->offset - offset) / 4, 26, "bl");
+                memcpy(text + offset, &word, 4);
+                continue;
+            }
+
+            if (!sym)
+            {
+                sym = add_obj_sym(cs->id, false, 0);
+            }
+            ObjReloc *rel = calloc(1, sizeof(ObjReloc));
+            rel->offset = offset;
+            rel->sym = sym;
+            rel->type = R_AARCH64_CALL26;
+            rel->next = obj_relocs;
+            obj_relocs = rel;
+        }
+        pos += fn->code_len;
+    }
+
+    write_elf(out, text, len, obj_syms, obj_relocs);
+    free(text);
+
+    while (obj_syms)
+    {
+        ObjSym *next = obj_syms->next;
+        free(obj_syms);
+        obj_syms = next;
+    }
+    obj_syms_last = NULL;
+    free(obj_sym_table);
+    obj_sym_table = NULL;
+    while (obj_relocs)
+    {
+        ObjReloc *next = obj_relocs->next;
+        free(obj_relocs);
+        obj_relocs = next;
+    }
+}
+
+void a64_prologue(Function *fn)
+{
+    funcname = fn->name;
+    a64_ninsns = 0;
+    if (a64_obj)
+    {
+        obj_text = NULL;
+        obj_len = 0;
+        obj_cap = 0;
+        obj_calls = NULL;
+        obj_branches = NULL;
+        for (int i = 0; i < obj_nlabels; i++)
+        {
+            obj_labels[i] = -1;
+        }
+    }
+    else
+    {
+        a64_out = open_memstream(&a64_buf, &a64_buflen);
+        fprintf(a64_out, ".globl %s\n", fn->name);
+        fprintf(a64_out, ".type %s, %%function\n", fn->name);
+        fprintf(a64_out, "%s:\n", fn->name);
+    }
+    emit_directive(".cfi_startproc");
+    a64_line = 0;
+    a64_loc(fn->tok);
+
+    // Prologue. the frame is addressed from x29 from here on:
+    // CFA = x29 + 16, with the caller's x29 saved at CFA - 16.
+    emit_push(FP);
+    emit_directive(".cfi_def_cfa_offset 16");
+    emit_directive(".cfi_offset 29, -16");
+    emit((A64Insn){A64_ADD_IMM, .rd = FP, .rn = SP});
+    emit_directive(".cfi_def_cfa_register 29");
+    emit_add_imm(A64_SUB_IMM, SP, SP, fn->stack_size);
+
+    // Push arguments to the stack
+    int i = 0;
+    for (VarList *vl = fn->params; vl; vl = vl->next)
+    {
+        Var *var = vl->var;
+        emit((A64Insn){A64_STR, .rd = i++, .rn = FP, .imm = -var->offset});
+    }
+}
+
+// the prologue runs on the thread that generates the function,
+// so it tells that thread which form of output to produce.
+void a64_text_prologue(Function *fn)
+{
+    a64_obj = false;
+    a64_prologue(fn);
+}
+
+void a64_obj_prologue(Function *fn)
+{
+    a64_obj = true;
+    a64_prologue(fn);
+}
+
+void a64_epilogue(Function *fn)
+{
+    emit((A64Insn){A64_LABEL, .label = LABEL_RETURN});
+    emit((A64Insn){A64_ADD_IMM, .rd = SP, .rn = FP});
+    emit_pop(FP);
+    emit_directive(".cfi_def_cfa 31, 0");
+    emit_directive(".cfi_restore 29");
+    emit((A64Insn){A64_RET});
+    emit_directive(".cfi_endproc");
+    fn->insn_count = a64_ninsns;
+
+    if (!a64_obj)
+    {
+        fprintf(a64_out, ".size %s, .-%s\n", fn->name, fn->name);
+        if (fn->ncounters)
+        {
+            fprintf(a64_out, ".section .bss\n");
+            fprintf(a64_out, "    .p2align 3\n");
+            fprintf(a64_out, ".Lprof.%s:\n", fn->name);
+            fprintf(a64_out, "    .zero %d\n", fn->ncounters * 8);
+            fprintf(a64_out, ".text\n");
+        }
+        fclose(a64_out);
+        fn->code = a64_buf;
+        fn->code_len = a64_buflen;
+        return;
+    }
+
+    for (A64Fixup *fx = obj_branches; fx; fx = fx->next)
+    {
+        int target = fx->label == LABEL_RETURN ? obj_return : obj_labels[fx->label];
+        long disp = (target - fx->pos) / 4;
+        unsigned int word;
+        memcpy(&word, obj_text + fx->pos, 4);
+        if ((word & 0xfc000000) == 0x14000000)
+        {
+            word |= enc_simm(disp, 26, "b");
+        }
+        else
+        {
+            word |= enc_simm(disp, 19, "cbz/cbnz") << 5;
+        }
+        memcpy(obj_text + fx->pos, &word, 4);
+    }
+    while (obj_branches)
+    {
+        A64Fixup *next = obj_branches->next;
+        free(obj_branches);
+        obj_branches = next;
+    }
+
+    fn->code = (char *)obj_text;
+    fn->code_len = obj_len;
+    fn->calls = obj_calls;
+}
+
+// `mov` can only encode a single 16-bit chunk, so wider
+// constants are assembled from movz/movk pieces.
+void gen_mov_imm(long val)
+{
+    if (-65536 <= val && val <= 65535)
+    {
+        emit((A64Insn){A64_MOV_IMM, .rd = X0, .imm = val});
+        return;
+    }
+
+    unsigned long v = val;
+    emit((A64Insn){A64_MOVZ, .rd = X0, .imm = v & 0xffff});
+    for (int shift = 16; shift < 64; shift += 16)
+    {
+        if ((v >> shift) & 0xffff)
+        {
+            emit((A64Insn){A64_MOVK, .rd = X0, .imm = (v >> shift) & 0xffff, .shift = shift});
+        }
+    }
+}
+
+void a64_push_imm(long val)
+{
+    gen_mov_imm(val);
+    emit((A64Insn){A64_SUB_IMM, .rd = SP, .rn = SP, .imm = 16});
+    emit((A64Insn){A64_STR, .rd = X0, .rn = SP});
+}
+
+void a64_push_var_addr(Var *var)
+{
+    emit_add_imm(A64_SUB_IMM, X0, FP, var->offset);
+    emit_push(X0);
+}
+
+void a64_pop()
+{
+    emit((A64Insn){A64_ADD_IMM, .rd = SP, .rn = SP, .imm = 16});
+}
+
+void a64_pop_result()
+{
+    emit((A64Insn){A64_LDR, .rd = X0, .rn = SP});
+    emit((A64Insn){A64_ADD_IMM, .rd = SP, .rn = SP, .imm = 16});
+}
+
+void a64_load()
+{
+    emit_pop(X0);
+    emit((A64Insn){A64_LDR, .rd = X0, .rn = X0});
+    emit_push(X0);
+}
+
+void a64_store()
+{
+    emit_pop(X1);
+    emit_pop(X0);
+    emit((A64Insn){A64_STR, .rd = X1, .rn = X0});
+    emit((A64Insn){A64_STR, .rd = X1, .rn = SP, .imm = -16});
+}
+
+void a64_binop(NodeKind kind)
+{
+    // load rhs value
+    emit((A64Insn){A64_LDR, .rd = X1, .rn = SP});
+    emit((A64Insn){A64_ADD_IMM, .rd = SP, .rn = SP, .imm = 16});
+
+    // load lhs value
+    emit((A64Insn){A64_LDR, .rd = X0, .rn = SP});
+    emit((A64Insn){A64_ADD_IMM, .rd = SP, .rn = SP, .imm = 16});
+
+    switch (kind)
+    {
+    case ND_ADD:
+        emit((A64Insn){A64_ADD, .rd = X0, .rn = X0, .rm = X1});
+        break;
+    case ND_SUB:
+        emit((A64Insn){A64_SUB, .rd = X0, .rn = X0, .rm = X1});
+        break;
+    case ND_MUL:
+        emit((A64Insn){A64_MUL, .rd = X0, .rn = X0, .rm = X1});
+        break;
+    case ND_DIV:
+        emit((A64Insn){A64_SDIV, .rd = X0, .rn = X0, .rm = X1});
+        break;
+    case ND_EQ:
+        emit((A64Insn){A64_CMP, .rn = X0, .rm = X1});
+        emit((A64Insn){A64_CSET, .rd = X0, .cond = COND_EQ});
+        break;
+    case ND_NE:
+        emit((A64Insn){A64_CMP, .rn = X0, .rm = X1});
+        emit((A64Insn){A64_CSET, .rd = X0, .cond = COND_NE});
+        break;
+    case ND_LE:
+        emit((A64Insn){A64_CMP, .rn = X0, .rm = X1});
+        emit((A64Insn){A64_CSET, .rd = X0, .cond = COND_LE});
+        break;
+    case ND_LT:
+        emit((A64Insn){A64_CMP, .rn = X0, .rm = X1});
+        emit((A64Insn){A64_CSET, .rd = X0, .cond = COND_LT});
+    }
+
+    emit((A64Insn){A64_SUB_IMM, .rd = SP, .rn = SP, .imm = 16});
+    emit((A64Insn){A64_STR, .rd = X0, .rn = SP});
+}
+
+void a64_funcall(int id, int nargs)
+{
+    for (int i = nargs - 1; i >= 0; i--)
+    {
+        emit((A64Insn){A64_LDR, .rd = i, .rn = SP});
+        emit((A64Insn){A64_ADD_IMM, .rd = SP, .rn = SP, .imm = 16});
+    }
+    emit((A64Insn){A64_STP_PRE, .rd = FP, .rm = LR, .rn = SP, .imm = -16});
+    emit((A64Insn){A64_ADD_IMM, .rd = FP, .rn = SP});
+
+    // during the call x29 points to the saved pair, so the frame is
+    // found through the x29 saved there: CFA = [x29] + 16, and the
+    // return address is at x29 + 8. these need DWARF expressions:
+    // DW_CFA_def_cfa_expression (DW_OP_breg29 0, DW_OP_deref,
+    // DW_OP_plus_uconst 16) and DW_CFA_expression x30 (DW_OP_breg29 8).
+    emit_directive(".cfi_escape 0x0f, 0x05, 0x8d, 0x00, 0x06, 0x23, 0x10");
+    emit_directive(".cfi_escape 0x10, 0x1e, 0x02, 0x8d, 0x08");
+    emit((A64Insn){A64_BL, .sym = id});
+    emit((A64Insn){A64_LDP_POST, .rd = FP, .rm = LR, .rn = SP, .imm = 16});
+    emit_directive(".cfi_def_cfa 29, 16");
+    emit_directive(".cfi_restore 30");
+    emit((A64Insn){A64_SUB_IMM, .rd = SP, .rn = SP, .imm = 16});
+    emit((A64Insn){A64_STR, .rd = X0, .rn = SP});
+}
+
+void a64_ret()
+{
+    emit_pop(X0);
+    emit((A64Insn){A64_B, .label = LABEL_RETURN});
+}
+
+void a64_branch_zero(LabelKind kind, int seq)
+{
+    emit((A64Insn){A64_LDR, .rd = X0, .rn = SP});
+    emit((A64Insn){A64_ADD_IMM, .rd = SP, .rn = SP, .imm = 16});
+    emit((A64Insn){A64_CBZ, .rd = X0, .label = seq * NUM_LABEL_KINDS + kind});
+}
+
+void a64_branch_nonzero(LabelKind kind, int seq)
+{
+    emit((A64Insn){A64_LDR, .rd = X0, .rn = SP});
+    emit((A64Insn){A64_ADD_IMM, .rd = SP, .rn = SP, .imm = 16});
+    emit((A64Insn){A64_CBNZ, .rd = X0, .label = seq * NUM_LABEL_KINDS + kind});
+}
+
+void a64_jump(LabelKind kind, int seq)
+{
+    emit((A64Insn){A64_B, .label = seq * NUM_LABEL_KINDS + kind});
+}
+
+void a64_label(LabelKind kind, int seq)
+{
+    emit((A64Insn){A64_LABEL, .label = seq * NUM_LABEL_KINDS + kind});
+}
+
+Backend aarch64_backend = {
+    .begin = a64_begin,
+    .end = a64_end,
+    .prologue = a64_text_prologue,
+    .epilogue = a64_epilogue,
+    .push_imm = a64_push_imm,
+    .push_var_addr = a64_push_var_addr,
+    .pop = a64_pop,
+    .pop_result = a64_pop_result,
+    .load = a64_load,
+    .store = a64_store,
+    .binop = a64_binop,
+    .funcall = a64_funcall,
+    .ret = a64_ret,
+    .branch_zero = a64_branch_zero,
+    .branch_nonzero = a64_branch_nonzero,
+    .jump = a64_jump,
+    .label = a64_label,
+    .loc = a64_loc,
+    .counter = a64_counter,
+    .counts_insns = true,
+};
+
+Backend aarch64_obj_backend = {
+    .begin = a64_obj_begin,
+    .end = a64_obj_end,
+    .prologue = a64_obj_prologue,
+    .epilogue = a64_epilogue,
+    .push_imm = a64_push_imm,
+    .push_var_addr = a64_push_var_addr,
+    .pop = a64_pop,
+    .pop_result = a64_pop_result,
+    .load = a64_load,
+    .store = a64_store,
+    .binop = a64_binop,
+    .funcall = a64_funcall,
+    .ret = a64_ret,
+    .branch_zero = a64_branch_zero,
+    .branch_nonzero = a64_branch_nonzero,
+    .jump = a64_jump,
+    .label = a64_label,
+    .counts_insns = true,
+};
@@ -0,0 +1,208 @@
+#!/bin/bash
+# Benchmarks of the code 9cc generates.
+#
+# Compiles a set of kernels, runs them natively on AArch64 hosts or
+# under qemu-aarch64 elsewhere, and reports for each kernel the number
+# of instructions it executes and the size of its .text. Instruction
+# counts come from perf on AArch64 hosts and from the libinsn.so plugin
+# of qemu elsewhere; the instructions of an empty program, which are
+# spent in the C runtime, are subtracted. Counts are reported as "-"
+# when neither is available.
+#
+#   ./bench-run.sh          run and compare against bench-run.baseline
+#   ./bench-run.sh --gcc    also compile the kernels with gcc -O0 and -O1
+#   ./bench-run.sh --save   run and save the results as bench-run.baseline
+#
+# On other hosts CROSS sets the prefix of the AArch64 toolchain
+# (default aarch64-linux-gnu-) and QEMU_PLUGIN the path of libinsn.so.
+
+baseline=bench-run.baseline
+gcc=
+save=
+for arg; do
+  case "$arg" in
+    --gcc) gcc=1 ;;
+    --save) save=1 ;;
+    *) echo "usage: $0 [--gcc] [--save]"; exit 1 ;;
+  esac
+done
+
+if [ "$(uname -m)" = aarch64 ]; then
+  cross=
+  runner=
+else
+  cross="${CROSS-aarch64-linux-gnu-}"
+  runner=qemu-aarch64
+  if ! command -v $runner > /dev/null; then
+    echo "$0: qemu-aarch64 is required to run AArch64 code on $(uname -m)"
+    exit 1
+  fi
+fi
+
+if ! command -v ${cross}gcc > /dev/null; then
+  echo "$0: ${cross}gcc not found"
+  exit 1
+fi
+
+# how instructions are counted: perf, qemu or nothing
+counter=
+if [ -z "$runner" ]; then
+  perf stat -e instructions:u true > /dev/null 2>&1 && counter=perf
+else
+  plugin="$QEMU_PLUGIN"
+  if [ -z "$plugin" ]; then
+    for p in /usr/lib/qemu/plugins/libinsn.so /usr/local/lib/qemu/plugins/libinsn.so \
+             /usr/lib/x86_64-linux-gnu/qemu/plugins/libinsn.so; do
+      [ -f "$p" ] && plugin="$p" && break
+    done
+  fi
+  [ -n "$plugin" ] && counter=qemu
+fi
+
+# each kernel has a 9cc program, the same program in C for gcc and the
+# exit status both must return
+kernels=(loop fib ptr calls gcd)
+
+loop_9cc='main() { s=0; for (i=0; i<1000000; i=i+1) s=s+i; return s-s/256*256; }'
+loop_c='int main() { long s=0; for (long i=0; i<1000000; i=i+1) s=s+i; return s-s/256*256; }'
+loop_expected=224
+
+fib_9cc='main() { return fib(27)-fib(27)/256*256; } fib(n) { if (n<2) return n; return fib(n-1)+fib(n-2); }'
+fib_c='long fib(long n) { if (n<2) return n; return fib(n-1)+fib(n-2); } int main() { return fib(27)-fib(27)/256*256; }'
+fib_expected=66
+
+# a0..a7 are laid out at decreasing addresses, so p walks through them
+ptr_9cc='main() { a0=0; a1=0; a2=0; a3=0; a4=0; a5=0; a6=0; a7=0;
+  for (i=0; i<100000; i=i+1) { p=&a0; for (j=0; j<8; j=j+1) { *p=*p+i*j; p=p-8; } }
+  s=a0+a1+a2+a3+a4+a5+a6+a7; return s-s/256*256; }'
+ptr_c='int main() { long a[8]={0}, *p, s=0;
+  for (long i=0; i<100000; i=i+1) { p=a; for (long j=0; j<8; j=j+1) { *p=*p+i*j; p=p+1; } }
+  for (long j=0; j<8; j=j+1) s=s+a[j]; return s-s/256*256; }'
+ptr_expected=64
+
+calls_9cc='main() { s=0; for (i=0; i<300000; i=i+1) s=add3(inc(s), dec(i), i); return s-s/256*256; }
+  add3(a, b, c) { return a+b+c; } inc(x) { return x+1; } dec(x) { return x-1; }'
+calls_c='long add3(long a, long b, long c) { return a+b+c; } long inc(long x) { return x+1; } long dec(long x) { return x-1; }
+  int main() { long s=0; for (long i=0; i<300000; i=i+1) s=add3(inc(s), dec(i), i); return s-s/256*256; }'
+calls_expected=32
+
+gcd_9cc='main() { s=0; for (i=1; i<300; i=i+1) for (j=1; j<300; j=j+1) s=s+gcd(i, j); return s-s/256*256; }
+  gcd(a, b) { while (b!=0) { t=a-a/b*b; a=b; b=t; } return a; }'
+gcd_c='long gcd(long a, long b) { while (b!=0) { long t=a-a/b*b; a=b; b=t; } return a; }
+  int main() { long s=0; for (long i=1; i<300; i=i+1) for (long j=1; j<300; j=j+1) s=s+gcd(i, j); return s-s/256*256; }'
+gcd_expected=108
+
+# runs the program $1 and prints the number of instructions it
+# executed, or "-" if they cannot be counted. exits if the status of
+# the program is not $2.
+run() {
+  case "$counter" in
+    perf)
+      out=$(perf stat -x, -e instructions:u "$1" 2>&1 > /dev/null)
+      status=$?
+      count=$(awk -F, '/instructions/ { print $1 }' <<<"$out")
+      ;;
+    qemu)
+      out=$($runner -plugin "$plugin" -d plugin "$1" 2>&1 > /dev/null)
+      status=$?
+      count=$(grep -o 'insns: [0-9]*' <<<"$out" | tail -1 | awk '{ print $2 }')
+      ;;
+    *)
+      $runner "$1" > /dev/null
+      status=$?
+      count=-
+      ;;
+  esac
+
+  if [ "$status" != "$2" ]; then
+    echo "$1: $2 expected, but got $status" >&2
+    exit 1
+  fi
+  echo "$count"
+}
+
+# prints the size of the .text section of the object $1
+text_size() {
+  ${cross}size -A "$1" | awk '$1 == ".text" { print $2 }'
+}
+
+# prints "<instructions> <size>" of the program $2 compiled by the
+# compiler $1: 9cc, O0 or O1
+measure() {
+  name="$3"
+  base="tmp-bench-run/$name.$1"
+  case "$1" in
+    9cc)
+      ./9cc "$2" > "$base.s" || exit 1
+      ./9cc -c "$2" > "$base.o" || exit 1
+      ;;
+    *)
+      echo "$2" > "$base.c"
+      ${cross}gcc -$1 -S -o "$base.s" "$base.c" || exit 1
+      ${cross}gcc -$1 -c -o "$base.o" "$base.c" || exit 1
+      ;;
+  esac
+  ${cross}gcc -static -o "$base" "$base.s" || exit 1
+
+  count=$(run "$base" "$4") || exit 1
+  if [ "$count" != - ]; then
+    count=$((count - overhead))
+  fi
+  echo "$count $(text_size "$base.o")"
+}
+
+make -s 9cc || exit 1
+rm -rf tmp-bench-run tmp-bench-run.out
+mkdir tmp-bench-run
+
+# instructions spent outside main
+echo 'int main() { return 0; }' > tmp-bench-run/empty.c
+${cross}gcc -static -o tmp-bench-run/empty tmp-bench-run/empty.c || exit 1
+overhead=$(run tmp-bench-run/empty 0) || exit 1
+
+header=$(printf '%-8s %12s %8s' kernel insns size)
+if [ -n "$gcc" ]; then
+  header="$header$(printf ' %12s %8s %12s %8s' 'O0 insns' 'O0 size' 'O1 insns' 'O1 size')"
+fi
+echo "$header  vs $baseline"
+
+regressed=
+for k in "${kernels[@]}"; do
+  src_9cc="${k}_9cc"
+  src_c="${k}_c"
+  expected="${k}_expected"
+
+  read insns size <<<"$(measure 9cc "${!src_9cc}" $k ${!expected})" || exit 1
+  [ -n "$size" ] || exit 1
+  echo "$k $insns $size" >> tmp-bench-run.out
+  line=$(printf '%-8s %12s %8s' $k $insns $size)
+
+  if [ -n "$gcc" ]; then
+    for opt in O0 O1; do
+      read g_insns g_size <<<"$(measure $opt "${!src_c}" $k ${!expected})" || exit 1
+      [ -n "$g_size" ] || exit 1
+      line="$line$(printf ' %12s %8s' $g_insns $g_size)"
+    done
+  fi
+
+  # instruction counts and sizes are deterministic, so any increase
+  # is a regression
+  change=
+  read b_insns b_size <<<"$([ -f $baseline ] && awk -v k=$k '$1 == k { print $2, $3 }' $baseline)"
+  if [ -n "$b_size" ]; then
+    change="size $(awk "BEGIN { printf \"%+d\", $size - $b_size }")"
+    if [ "$insns" != - ] && [ "$b_insns" != - ]; then
+      change="insns $(awk "BEGIN { printf \"%+.2f%%\", ($insns - $b_insns) / $b_insns * 100 }"), $change"
+      [ "$insns" -gt "$b_insns" ] && regressed=1 && change="$change REGRESSION"
+    fi
+    [ "$size" -gt "$b_size" ] && regressed=1 && [[ "$change" != *REGRESSION ]] && change="$change REGRESSION"
+  fi
+  echo "$line  $change"
+done
+
+if [ -n "$save" ]; then
+  mv tmp-bench-run.out $baseline
+  echo "saved $baseline"
+fi
+
+[ -z "$regressed" ]
@@ -0,0 +1,138 @@
+#!/bin/bash
+# Compile-time benchmarks.
+#
+# Generates stress inputs, compiles each of them several times and
+# reports the median end-to-end latency, tokenizer throughput (tokens
+# per second of the tokenize phase) and parser throughput (nodes per
+# second of the parse phase). The inputs are generated the same way
+# on every run, so results are comparable between builds.
+#
+#   ./bench.sh          run and compare against bench.baseline
+#   ./bench.sh --save   run and save the results as bench.baseline
+#
+# RUNS sets the number of runs per input (default 5) and THRESHOLD the
+# latency increase in percent reported as a regression (default 10).
+
+runs="${RUNS:-5}"
+threshold="${THRESHOLD:-10}"
+baseline=bench.baseline
+
+# x+x+...+x as a single expression
+gen_chain() {
+  n="$1"
+  printf 'main() { x=1; return x'
+  for ((i = 1; i < n; i++)); do
+    printf '+x'
+  done
+  printf '; }\n'
+}
+
+# many small functions called from main
+gen_funcs() {
+  n="$1"
+  printf 'main() { return f0(1); }\n'
+  for ((i = 0; i < n; i++)); do
+    printf 'f%d(x) { y=x*%d; if (y<0) return 0; return y+%d; }\n' $i $i $i
+  done
+}
+
+# one function with many locals
+gen_locals() {
+  n="$1"
+  printf 'main() {\n'
+  for ((i = 0; i < n; i++)); do
+    printf '  v%d=%d;\n' $i $i
+  done
+  printf '  s=0;\n'
+  for ((i = 0; i < n; i++)); do
+    printf '  s=s+v%d;\n' $i
+  done
+  printf '  return s;\n}\n'
+}
+
+# deeply nested if and while blocks
+gen_nest() {
+  n="$1"
+  printf 'main() { x=0;\n'
+  for ((i = 0; i < n; i++)); do
+    if ((i % 2)); then
+      printf 'while (x<%d) { x=x+1;\n' $i
+    else
+      printf 'if (x<%d) {\n' $i
+    fi
+  done
+  for ((i = 0; i < n; i++)); do
+    printf '}\n'
+  done
+  printf 'return x; }\n'
+}
+
+# prints the median of its arguments
+median() {
+  printf '%s\n' "$@" | sort -g | awk '{ v[NR] = $1 } END { print v[int((NR + 1) / 2)] }'
+}
+
+# prints the number that follows the first match of $2 in the
+# --stats=json output $1
+json_field() {
+  grep -o "$2 [0-9.]*" <<<"$1" | head -1 | awk '{ print $NF }'
+}
+
+bench() {
+  name="$1"
+  file="tmp-bench/$name.c"
+  gen_$name "$2" > "$file"
+
+  # warm up the page cache
+  ./9cc "$file" > /dev/null || exit 1
+
+  lat=()
+  tps=()
+  nps=()
+  for ((r = 0; r < runs; r++)); do
+    start=$EPOCHREALTIME
+    stats=$(./9cc --stats=json "$file" 2>&1 > /dev/null) || exit 1
+    end=$EPOCHREALTIME
+    tokens=$(json_field "$stats" '"tokens":')
+    nodes=$(json_field "$stats" '"nodes":')
+    tok_ms=$(json_field "$stats" '"tokenize": {"wall_ms":')
+    parse_ms=$(json_field "$stats" '"parse": {"wall_ms":')
+    lat+=($(awk "BEGIN { print ($end - $start) * 1e3 }"))
+    tps+=($(awk "BEGIN { print $tokens / ($tok_ms / 1e3 + 1e-9) }"))
+    nps+=($(awk "BEGIN { print $nodes / ($parse_ms / 1e3 + 1e-9) }"))
+  done
+
+  lat=$(median "${lat[@]}")
+  tps=$(median "${tps[@]}")
+  nps=$(median "${nps[@]}")
+  echo "$name $lat $tps $nps" >> tmp-bench.out
+
+  change=
+  base=$([ -f $baseline ] && awk -v n=$name '$1 == n { print $2 }' $baseline)
+  if [ -n "$base" ]; then
+    change=$(awk "BEGIN { printf \"%+.1f%%\", ($lat - $base) / $base * 100 }")
+    if awk "BEGIN { exit !(($lat - $base) / $base * 100 > $threshold) }"; then
+      change="$change REGRESSION"
+      regressed=1
+    fi
+  fi
+  printf '%-8s %10.3f %12.0f %12.0f  %s\n' $name $lat $tps $nps "$change"
+}
+
+make -s 9cc || exit 1
+rm -rf tmp-bench tmp-bench.out
+mkdir tmp-bench
+regressed=
+
+printf '%-8s %10s %12s %12s  %s\n' input 'ms' 'tokens/s' 'nodes/s' "vs $baseline"
+bench chain 20000
+bench funcs 3000
+bench locals 3000
+bench nest 1000
+
+if [ "$1" = --save ]; then
+  mv tmp-bench.out $baseline
+  echo "saved $baseline"
+fi
+
+[ -z "$regressed" ]
@@ -0,0 +1,211 @@
+#include "9cc.h"
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// On-disk cache of the assembly of functions.
+//
+// A function is compiled to the same code whenever its tokens are the
+// same, since labels are named after the function and nothing else of
+// the program is used. Its tokens are hashed into a key, and the code
+// is stored in <cache_dir>/<key>.s. The key also covers the compiler
+// binary, so that rebuilding 9cc invalidates every entry.
+//
+// Line info is stored relative to the first token of the function, so
+// that moving a function within its file, as when lines are inserted
+// above it, does not invalidate its entry.
+
+// bumped whenever the format of entries changes
+#define CACHE_VERSION 3
+
+char *cache_dir;
+unsigned long compiler_hash;
+
+// 64-bit FNV-1a
+unsigned long fnv_hash(unsigned long h, void *data, long len)
+{
+    unsigned char *p = data;
+    for (long i = 0; i < len; i++)
+    {
+        h ^= p[i];
+        h *= 0x100000001b3;
+    }
+    return h;
+}
+
+#define FNV_INIT 0xcbf29ce484222325
+
+unsigned long hash_file(char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+    {
+        error("cannot open %s: %s", path, strerror(errno));
+    }
+
+    unsigned long h = FNV_INIT;
+    char buf[65536];
+    size_t len;
+    while ((len = fread(buf, 1, sizeof(buf), fp)) > 0)
+    {
+        h = fnv_hash(h, buf, len);
+    }
+    fclose(fp);
+    return h;
+}
+
+void cache_init(char *dir)
+{
+    if (mkdir(dir, 0777) && errno != EEXIST)
+    {
+        error("cannot create %s: %s", dir, strerror(errno));
+    }
+    cache_dir = dir;
+
+    int version = CACHE_VERSION;
+    compiler_hash = hash_file("/proc/self/exe");
+    compiler_hash = fnv_hash(compiler_hash, &version, sizeof(version));
+}
+
+// the position of tok relative to first. columns are only relative on
+// the first line, since the other lines start at column 1 wherever the
+// function is.
+void relative_pos(Token *first, int line, int col, int *rel_line, int *rel_col)
+{
+    *rel_line = line - first->line;
+    *rel_col = line == first->line ? col - first->col : col;
+}
+
+// hashes the tokens of a function. the spelling of each token is
+// used rather than the source text, so whitespace only matters
+// through the positions that the line info refers to. line info is
+// only emitted for named files, so that is part of the key too.
+unsigned long hash_function(Token *tok)
+{
+    unsigned long h = fnv_hash(FNV_INIT, &compiler_hash, sizeof(compiler_hash));
+    bool lines = filename != NULL;
+    h = fnv_hash(h, &lines, sizeof(lines));
+    for (Token *first = tok; tok && tok->kind != TK_EOF; tok = tok->next)
+    {
+        int pos[2];
+        relative_pos(first, tok->line, tok->col, &pos[0], &pos[1]);
+        h = fnv_hash(h, &tok->kind, sizeof(tok->kind));
+        h = fnv_hash(h, &tok->len, sizeof(tok->len));
+        h = fnv_hash(h, tok->str, tok->len);
+        h = fnv_hash(h, pos, sizeof(pos));
+    }
+    return h;
+}
+
+// rewrites the ".loc" lines of code[0..*len) relative to the first
+// token of the function, or back to absolute positions. returns the
+// new code and stores its length in len.
+char *rebase_locs(char *code, int *len, Token *first, bool to_relative)
+{
+    char *buf;
+    size_t size;
+    FILE *out = open_memstream(&buf, &size);
+    char *end = code + *len;
+    for (char *p = code; p < end;)
+    {
+        char *eol = memchr(p, '\n', end - p);
+        char *next = eol ? eol + 1 : end;
+        int line, col;
+        if (!strncmp(p, "    .loc 1 ", 11) && sscanf(p + 11, "%d %d", &line, &col) == 2)
+        {
+            if (to_relative)
+            {
+                relative_pos(first, line, col, &line, &col);
+            }
+            else
+            {
+                col = line == 0 ? col + first->col : col;
+                line += first->line;
+            }
+            fprintf(out, "    .loc 1 %d %d\n", line, col);
+        }
+        else
+        {
+            fwrite(p, 1, next - p, out);
+        }
+        p = next;
+    }
+    fclose(out);
+    *len = size;
+    return buf;
+}
+
+char *cache_path(unsigned long key)
+{
+    int len = strlen(cache_dir) + 22;
+    char *path = malloc(len);
+    snprintf(path, len, "%s/%016lx.s", cache_dir, key);
+    return path;
+}
+
+// returns the cached code of key, with its line info placed at the
+// function starting at tok, and stores its length in len. returns NULL
+// on a miss.
+char *cache_read(unsigned long key, int *len, Token *tok)
+{
+    char *path = cache_path(key);
+    FILE *fp = fopen(path, "r");
+    free(path);
+    if (!fp)
+    {
+        return NULL;
+    }
+
+    char *code;
+    size_t size;
+    FILE *out = open_memstream(&code, &size);
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+    {
+        fwrite(buf, 1, n, out);
+    }
+    fclose(out);
+    fclose(fp);
+    *len = size;
+
+    char *rebased = rebase_locs(code, len, tok, false);
+    free(code);
+    return rebased;
+}
+
+// stores the code of the function starting at tok under key. the
+// entry is written to a temporary file and renamed, so concurrent
+// compiles never see a partial entry. the cache is only an
+// optimization, so a failed write is reported and the compile goes on.
+void cache_write(unsigned long key, char *code, int len, Token *tok)
+{
+    code = rebase_locs(code, &len, tok, true);
+    char *path = cache_path(key);
+    char *tmp = malloc(strlen(path) + 8);
+    sprintf(tmp, "%s.XXXXXX", path);
+
+    int fd = mkstemp(tmp);
+    FILE *fp = fd < 0 ? NULL : fdopen(fd, "w");
+    if (!fp)
+    {
+        fprintf(stderr, "warning: cannot open %s: %s\n", tmp, strerror(errno));
+        if (fd >= 0)
+        {
+            close(fd);
+            unlink(tmp);
+        }
+    }
+    else
+    {
+        fwrite(code, 1, len, fp);
+        if (ferror(fp) | fclose(fp) || rename(tmp, path))
+        {
+            fprintf(stderr, "warning: cannot write %s: %s\n", path, strerror(errno));
+            unlink(tmp);
+        }
+    }
+    free(code);
+    free(tmp);
+    free(path);
+}
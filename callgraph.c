@@ -0,0 +1,260 @@
+#include "9cc.h"
+
+// Call graph built from the ND_FUNCALL nodes of each function.
+// It is used to drop functions that cannot be reached from the
+// entry points and to place callees right after their callers.
+
+// edge of the function being scanned to each callee, indexed by
+// interned name, so that repeated calls find their edge directly
+_Thread_local CallEdge **edge_of;
+
+// last edge of the caller, so that edges keep the order of the first
+// call site
+_Thread_local CallEdge *last_edge;
+
+void add_edge(Function *caller, Node *call)
+{
+    CallEdge *e = edge_of[call->funcid];
+    if (e)
+    {
+        e->count++;
+        return;
+    }
+
+    e = calloc(1, sizeof(CallEdge));
+    e->name = call->funcname;
+    e->id = call->funcid;
+    e->fn = find_func(call->funcid);
+    e->count = 1;
+    if (last_edge)
+    {
+        last_edge->next = e;
+    }
+    else
+    {
+        caller->callees = e;
+    }
+    last_edge = e;
+    edge_of[call->funcid] = e;
+}
+
+// visits the nodes in the same order as a recursive walk of the
+// children and then the `next` chain, using an explicit stack so that
+// deeply nested code cannot overflow the C stack.
+void collect_calls(Function *caller, Node *node)
+{
+    int cap = 64;
+    Node **stack = malloc(cap * sizeof(Node *));
+    int sp = 0;
+    stack[sp++] = node;
+
+    while (sp)
+    {
+        Node *n = stack[--sp];
+        if (!n)
+        {
+            continue;
+        }
+        if (n->kind == ND_FUNCALL)
+        {
+            add_edge(caller, n);
+        }
+
+        if (cap < sp + 10)
+        {
+            cap *= 2;
+            stack = realloc(stack, cap * sizeof(Node *));
+        }
+        // pushed in reverse, so that lhs is visited first and next last
+        stack[sp++] = n->next;
+        stack[sp++] = n->args;
+        stack[sp++] = n->body;
+        stack[sp++] = n->inc;
+        stack[sp++] = n->init;
+        stack[sp++] = n->els;
+        stack[sp++] = n->then;
+        stack[sp++] = n->cond;
+        stack[sp++] = n->rhs;
+        stack[sp++] = n->lhs;
+    }
+    free(stack);
+}
+
+void build_callgraph(Function *prog)
+{
+    edge_of = calloc(num_idents() + 1, sizeof(CallEdge *));
+    for (Function *fn = prog; fn; fn = fn->next)
+    {
+        fn->callees = NULL;
+        last_edge = NULL;
+        collect_calls(fn, fn->node);
+        for (CallEdge *e = fn->callees; e; e = e->next)
+        {
+            edge_of[e->id] = NULL;
+        }
+    }
+    free(edge_of);
+    edge_of = NULL;
+}
+
+// marks fn and the functions it reaches. stack has room for every
+// function, since each one is pushed once, when it is marked.
+void mark_from(Function *fn, Function **stack)
+{
+    if (fn->reachable)
+    {
+        return;
+    }
+
+    int sp = 0;
+    fn->reachable = true;
+    stack[sp++] = fn;
+    while (sp)
+    {
+        for (CallEdge *e = stack[--sp]->callees; e; e = e->next)
+        {
+            if (e->fn && !e->fn->reachable)
+            {
+                e->fn->reachable = true;
+                stack[sp++] = e->fn;
+            }
+        }
+    }
+}
+
+// marks the functions reachable from the entry points. without
+// explicit entry points every function is kept, since it may be
+// called from another translation unit.
+void mark_reachable(Function *prog, char **entries, int nentries)
+{
+    int n = 0;
+    for (Function *fn = prog; fn; fn = fn->next)
+    {
+        fn->reachable = nentries == 0;
+        n++;
+    }
+
+    Function **stack = calloc(n + 1, sizeof(Function *));
+    for (int i = 0; i < nentries; i++)
+    {
+        Function *fn = find_func(intern(entries[i], strlen(entries[i])));
+        if (!fn)
+        {
+            error("entry point '%s' is not defined", entries[i]);
+        }
+        mark_from(fn, stack);
+    }
+    free(stack);
+}
+
+// appends fn and the functions it reaches, depth first, after tail and
+// returns the new tail. each entry of stack is the next edge to follow
+// of a placed function. it has room for every function, since each one
+// is pushed once, when it is placed.
+Function *place_from(Function *fn, Function *tail, CallEdge **stack)
+{
+    int sp = 0;
+    tail->next = fn;
+    tail = fn;
+    fn->placed = true;
+    stack[sp++] = fn->callees;
+
+    while (sp)
+    {
+        CallEdge *e = stack[sp - 1];
+        if (!e)
+        {
+            sp--;
+            continue;
+        }
+        stack[sp - 1] = e->next;
+
+        if (e->fn && e->fn->reachable && !e->fn->placed)
+        {
+            tail->next = e->fn;
+            tail = e->fn;
+            tail->placed = true;
+            stack[sp++] = tail->callees;
+        }
+    }
+    return tail;
+}
+
+// returns the reachable functions in depth-first order of the call
+// graph starting at the entry points, so that each caller is followed
+// by the callees it reaches first. unreachable functions are removed.
+Function *layout_functions(Function *prog, char **entries, int nentries)
+{
+    Function head;
+    head.next = NULL;
+    Function *tail = &head;
+
+    // walk a snapshot of the source order since placing rewrites `next`
+    int n = 0;
+    for (Function *fn = prog; fn; fn = fn->next)
+    {
+        fn->placed = false;
+        n++;
+    }
+    Function **order = calloc(n + 1, sizeof(Function *));
+    n = 0;
+    for (Function *fn = prog; fn; fn = fn->next)
+    {
+        order[n++] = fn;
+    }
+
+    CallEdge **stack = calloc(n + 1, sizeof(CallEdge *));
+    Function **roots = calloc(nentries + 1, sizeof(Function *));
+    for (int i = 0; i < nentries; i++)
+    {
+        roots[i] = find_func(intern(entries[i], strlen(entries[i])));
+    }
+
+    for (int i = 0; i < nentries; i++)
+    {
+        if (!roots[i]->placed)
+        {
+            tail = place_from(roots[i], tail, stack);
+        }
+    }
+    for (int i = 0; i < n; i++)
+    {
+        if (order[i]->reachable && !order[i]->placed)
+        {
+            tail = place_from(order[i], tail, stack);
+        }
+    }
+    tail->next = NULL;
+
+    free(stack);
+    free(roots);
+    free(order);
+    return group_hot_functions(head.next);
+}
+
+// prints the call graph in Graphviz dot format. functions defined
+// elsewhere are drawn as boxes and unreachable ones dashed.
+void dump_callgraph(Function *prog, FILE *out)
+{
+    fprintf(out, "digraph callgraph {\n");
+    for (Function *fn = prog; fn; fn = fn->next)
+    {
+        fprintf(out, "    \"%s\"%s;\n", fn->name, fn->reachable ? "" : " [style=dashed]");
+    }
+    // an external function is declared once, however many call it
+    bool *declared = calloc(num_idents() + 1, sizeof(bool));
+    for (Function *fn = prog; fn; fn = fn->next)
+    {
+        for (CallEdge *e = fn->callees; e; e = e->next)
+        {
+            if (!e->fn && !declared[e->id])
+            {
+                declared[e->id] = true;
+                fprintf(out, "    \"%s\" [shape=box];\n", e->name);
+            }
+            fprintf(out, "    \"%s\" -> \"%s\" [label=%d];\n", fn->name, e->name, e->count);
+        }
+    }
+    fprintf(out, "}\n");
+    free(declared);
+}
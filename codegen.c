@@ -1,18 +1,62 @@
 #include "9cc.h"
+#include <pthread.h>
+#include <stdatomic.h>
 
-int labelseq = 0;
-char *funcname;
-char *argreg[] = {"x0", "x1", "x2", "x3", "x4", "x5"};
+// Target-independent part of code generation.
+//
+// The AST is walked as code for a stack machine: every expression
+// pushes its value, and the backend decides how each stack operation
+// is turned into instructions.
+//
+// Functions are generated independently of each other, so they can
+// be spread over several threads. Each one gets its own label numbers
+// and output buffer, and the backend joins the buffers in list order.
+// All state is thread-local, so several programs can be compiled at
+// the same time as well.
+
+_Thread_local int labelseq;
+_Thread_local Backend *backend;
+_Thread_local Function *gen_fn; // function being generated
+int codegen_threads = 1;
+
+// functions waiting for a worker thread
+typedef struct CodegenQueue CodegenQueue;
+struct CodegenQueue
+{
+    Backend *backend;
+    char *filename;
+    char *input_label;
+    char *user_input;
+    Function **funcs;
+    int nfuncs;
+    atomic_int next;
+    atomic_bool failed; // a worker reported an error
+};
 
 void gen(Node *node);
 
+// with --profile-generate, makes the code count how often it gets here
+void gen_counter(CounterKind kind, int seq)
+{
+    if (!profile_output)
+    {
+        return;
+    }
+    Counter *c = calloc(1, sizeof(Counter));
+    c->kind = kind;
+    c->seq = seq;
+    c->index = gen_fn->ncounters++;
+    c->next = gen_fn->counters;
+    gen_fn->counters = c;
+    backend->counter(c->index);
+}
+
 void gen_addr(Node *node)
 {
     switch (node->kind)
     {
     case ND_VAR:
-        printf("    sub x0, x29, %d\n", node->var->offset);
-        printf("    str x0, [sp, -16]!\n");
+        backend->push_var_addr(node->var);
         return;
     case ND_DEREF:
         gen(node->lhs);
@@ -22,80 +66,91 @@ void gen_addr(Node *node)
     error_tok(node->tok, "not an lvalue");
 }
 
-void load()
-{
-    printf("    ldr x0, [sp], 16\n");
-    printf("    ldr x0, [x0]\n");
-    printf("    str x0, [sp, -16]!\n");
-}
-
-void store()
-{
-    printf("    ldr x1, [sp], 16\n");
-    printf("    ldr x0, [sp], 16\n");
-    printf("    str x1, [x0]\n");
-    printf("    str x1, [sp, -16]\n");
-}
-
 void gen(Node *node)
 {
+    if (backend->loc && node->tok)
+    {
+        backend->loc(node->tok);
+    }
+
     switch (node->kind)
     {
     case ND_NUM:
-        printf("    mov x0, %d\n", node->val);
-        printf("    sub sp, sp, 16\n");
-        printf("    str x0, [sp, 0]\n");
+        backend->push_imm(node->val);
         return;
     case ND_EXPR_STMT:
         gen(node->lhs);
-        printf("    add sp, sp, 16\n");
+        backend->pop();
         return;
     case ND_RETURN:
         gen(node->lhs);
-        printf("    ldr x0, [sp], 16\n");
-        printf("    b .Lreturn.%s\n", funcname);
+        backend->ret();
         return;
     case ND_ADDR:
         gen_addr(node->lhs);
         return;
     case ND_DEREF:
         gen(node->lhs);
-        load();
+        backend->load();
         return;
     case ND_IF:
         int seq = labelseq++;
-        if (node->els)
+        gen(node->cond);
+        if (node->els && profile_prefers_else(gen_fn, seq))
         {
-            gen(node->cond);
-            printf("    ldr x0, [sp, 0]\n");
-            printf("    add sp, sp, 16\n");
-            printf("    cbz x0, .Lelse%d\n", seq);
-            gen(node->then);
-            printf("    b .Lend%d\n", seq);
-            printf(".Lelse%d:\n", seq);
+            // the profile says else is the hot branch, so it is
+            // the one that falls through
+            backend->branch_nonzero(LB_THEN, seq);
+            gen_counter(PC_ELSE, seq);
             gen(node->els);
-            printf(".Lend%d:\n", seq);
+            backend->jump(LB_END, seq);
+            backend->label(LB_THEN, seq);
+            gen_counter(PC_THEN, seq);
+            gen(node->then);
+        }
+        else if (node->els || profile_output)
+        {
+            // counting the skipped then branch needs an else branch
+            backend->branch_zero(LB_ELSE, seq);
+            gen_counter(PC_THEN, seq);
+            gen(node->then);
+            backend->jump(LB_END, seq);
+            backend->label(LB_ELSE, seq);
+            gen_counter(PC_ELSE, seq);
+            if (node->els)
+            {
+                gen(node->els);
+            }
         }
         else
         {
-            gen(node->cond);
-            printf("    ldr x0, [sp, 0]\n");
-            printf("    add sp, sp, 16\n");
-            printf("    cbz x0, .Lend%d\n", seq);
+            backend->branch_zero(LB_END, seq);
             gen(node->then);
-            printf(".Lend%d:\n", seq);
         }
+        backend->label(LB_END, seq);
         return;
     case ND_WHILE:
         seq = labelseq++;
-        printf(".Lbegin%d:\n", seq);
+        if (profile_rotates_loop(gen_fn, seq))
+        {
+            // the profile says the loop repeats, so the condition is
+            // tested at the bottom and each iteration takes one branch
+            backend->jump(LB_COND, seq);
+            backend->label(LB_BEGIN, seq);
+            gen(node->then);
+            backend->label(LB_COND, seq);
+            gen(node->cond);
+            backend->branch_nonzero(LB_BEGIN, seq);
+            backend->label(LB_END, seq);
+            return;
+        }
+        backend->label(LB_BEGIN, seq);
         gen(node->cond);
-        printf("    ldr x0, [sp, 0]\n");
-        printf("    add sp, sp, 16\n");
-        printf("    cbz x0, .Lend%d\n", seq);
+        backend->branch_zero(LB_END, seq);
         gen(node->then);
-        printf("    b .Lbegin%d\n", seq);
-        printf(".Lend%d:\n", seq);
+        gen_counter(PC_LOOP, seq);
+        backend->jump(LB_BEGIN, seq);
+        backend->label(LB_END, seq);
         return;
     case ND_FOR:
         seq = labelseq++;
@@ -103,21 +158,35 @@ void gen(Node *node)
         {
             gen(node->init);
         }
-        printf(".Lbegin%d:\n", seq);
+        if (node->cond && profile_rotates_loop(gen_fn, seq))
+        {
+            backend->jump(LB_COND, seq);
+            backend->label(LB_BEGIN, seq);
+            gen(node->then);
+            if (node->inc)
+            {
+                gen(node->inc);
+            }
+            backend->label(LB_COND, seq);
+            gen(node->cond);
+            backend->branch_nonzero(LB_BEGIN, seq);
+            backend->label(LB_END, seq);
+            return;
+        }
+        backend->label(LB_BEGIN, seq);
         if (node->cond)
         {
             gen(node->cond);
-            printf("    ldr x0, [sp, 0]\n");
-            printf("    add sp, sp, 16\n");
-            printf("    cbz x0, .Lend%d\n", seq);
+            backend->branch_zero(LB_END, seq);
         }
         gen(node->then);
         if (node->inc)
         {
             gen(node->inc);
         }
-        printf("    b .Lbegin%d\n", seq);
-        printf(".Lend%d:\n", seq);
+        gen_counter(PC_LOOP, seq);
+        backend->jump(LB_BEGIN, seq);
+        backend->label(LB_END, seq);
         return;
     case ND_BLOCK:
         for (Node *n = node->body; n; n = n->next)
@@ -132,107 +201,125 @@ void gen(Node *node)
             gen(arg);
             nargs++;
         }
-        for (int i = nargs - 1; i >= 0; i--)
-        {
-            printf("    ldr %s, [sp, 0]\n", argreg[i]);
-            printf("    add sp, sp, 16\n");
-        }
-        printf("    stp x29, x30, [sp, -16]!\n");
-        printf("    mov x29, sp\n");
-        printf("    bl %s\n", node->funcname);
-        printf("    ldp x29, x30, [sp], 16\n");
-        printf("    sub sp, sp, #16\n");
-        printf("    str x0, [sp]\n");
+        backend->funcall(node->funcid, nargs);
         return;
     case ND_VAR:
         gen_addr(node);
-        load();
+        backend->load();
         return;
     case ND_ASSIGN:
         gen_addr(node->lhs);
         gen(node->rhs);
-        store();
+        backend->store();
         return;
     }
 
     gen(node->lhs);
     gen(node->rhs);
+    backend->binop(node->kind);
+}
 
-    // load rhs value
-    printf("    ldr x1, [sp, 0]\n");
-    printf("    add sp, sp, 16\n");
+void gen_function(Function *fn)
+{
+    labelseq = 0;
+    gen_fn = fn;
+    backend->prologue(fn);
+    gen_counter(PC_ENTRY, 0);
 
-    // load lhs value
-    printf("    ldr x0, [sp, 0]\n");
-    printf("    add sp, sp, 16\n");
+    // code generation walking the AST.
+    for (Node *n = fn->node; n; n = n->next)
+    {
+        gen(n);
+        backend->pop_result();
+    }
 
-    switch (node->kind)
+    backend->epilogue(fn);
+}
+
+void *codegen_worker(void *arg)
+{
+    CodegenQueue *q = arg;
+    backend = q->backend;
+
+    // for line info and error messages
+    filename = q->filename;
+    input_label = q->input_label;
+    user_input = q->user_input;
+
+    // an error stops the workers, and the thread that joins them fails
+    // in turn, so that --batch goes on with the next program
+    jmp_buf jmp;
+    if (setjmp(jmp))
     {
-    case ND_ADD:
-        printf("    add x0, x0, x1\n");
-        break;
-    case ND_SUB:
-        printf("    sub x0, x0, x1\n");
-        break;
-    case ND_MUL:
-        printf("    mul x0, x0, x1\n");
-        break;
-    case ND_DIV:
-        printf("    sdiv x0, x0, x1\n");
-        break;
-    case ND_EQ:
-        printf("    cmp x0, x1\n");
-        printf("    cset x0, eq\n");
-        break;
-    case ND_NE:
-        printf("    cmp x0, x1\n");
-        printf("    cset x0, ne\n");
-        break;
-    case ND_LE:
-        printf("    cmp x0, x1\n");
-        printf("    cset x0, le\n");
-        break;
-    case ND_LT:
-        printf("    cmp x0, x1\n");
-        printf("    cset x0, lt\n");
+        atomic_store(&q->failed, true);
+        free_local_idents();
+        return NULL;
     }
+    error_jmp = &jmp;
 
-    printf("    sub sp, sp, 16\n");
-    printf("    str x0, [sp, 0]\n");
+    for (;;)
+    {
+        int i = atomic_fetch_add(&q->next, 1);
+        if (i >= q->nfuncs || atomic_load(&q->failed))
+        {
+            free_local_idents();
+            return NULL;
+        }
+        gen_function(q->funcs[i]);
+    }
 }
 
-void codegen(Function *prog)
+void codegen(Function *prog, Backend *be, FILE *out)
 {
+    backend = be;
+    backend->begin(prog);
+
+    int nfuncs = 0;
     for (Function *fn = prog; fn; fn = fn->next)
     {
-        printf(".globl %s\n", fn->name);
-        printf("%s:\n", fn->name);
-        funcname = fn->name;
-
-        // Prologue
-        printf("    str x29, [sp, -16]!\n");
-        printf("    mov x29, sp\n");
-        printf("    sub sp, sp, %d\n", fn->stack_size);
+        nfuncs++;
+    }
 
-        // Push arguments to the stack
+    int nthreads = codegen_threads < nfuncs ? codegen_threads : nfuncs;
+    if (nthreads <= 1)
+    {
+        for (Function *fn = prog; fn; fn = fn->next)
+        {
+            gen_function(fn);
+        }
+    }
+    else
+    {
+        CodegenQueue q = {.backend = be, .filename = filename, .input_label = input_label, .user_input = user_input, .nfuncs = nfuncs};
+        q.funcs = calloc(nfuncs, sizeof(Function *));
         int i = 0;
-        for (VarList *vl = fn->params; vl; vl = vl->next)
+        for (Function *fn = prog; fn; fn = fn->next)
         {
-            Var *var = vl->var;
-            printf("    str %s, [x29, -%d]\n", argreg[i++], var->offset);
+            q.funcs[i++] = fn;
         }
+        atomic_init(&q.next, 0);
+        atomic_init(&q.failed, false);
 
-        // code generation walking the AST.
-        for (Node *n = fn->node; n; n = n->next)
+        pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+        for (i = 0; i < nthreads; i++)
         {
-            gen(n);
-            printf("    ldr x0, [sp, 0]\n");
-            printf("    add sp, sp, 16\n");
+            if (pthread_create(&threads[i], NULL, codegen_worker, &q))
+            {
+                error("cannot create thread");
+            }
+        }
+        for (i = 0; i < nthreads; i++)
+        {
+            pthread_join(threads[i], NULL);
+        }
+        free(threads);
+        free(q.funcs);
+        if (atomic_load(&q.failed))
+        {
+            // the worker has printed the message
+            error_exit();
         }
-
-        printf(".Lreturn.%s:\n", funcname);
-        printf("    mov sp, x29\n");
-        printf("    ldr x29, [sp], 16\n");
-        printf("    ret\n");
     }
+
+    backend->end(prog, out);
 }
@@ -0,0 +1,189 @@
+#include "9cc.h"
+#include <elf.h>
+
+// Writer for AArch64 ELF relocatable objects.
+//
+// The object has a single .text section. Functions defined in it are
+// global symbols, and calls to functions defined elsewhere become
+// undefined symbols referenced by relocations.
+
+enum
+{
+    SEC_NULL,
+    SEC_TEXT,
+    SEC_RELA_TEXT,
+    SEC_SYMTAB,
+    SEC_STRTAB,
+    SEC_SHSTRTAB,
+    SEC_NOTE_STACK,
+    NUM_SECTIONS,
+};
+
+// growable byte buffer
+typedef struct Buf Buf;
+struct Buf
+{
+    char *data;
+    int len;
+    int cap;
+};
+
+void buf_write(Buf *buf, void *data, int len)
+{
+    if (buf->cap < buf->len + len)
+    {
+        buf->cap = buf->cap ? buf->cap * 2 : 256;
+        while (buf->cap < buf->len + len)
+        {
+            buf->cap *= 2;
+        }
+        buf->data = realloc(buf->data, buf->cap);
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+// appends a NUL-terminated string and returns its offset
+int buf_str(Buf *buf, char *s)
+{
+    int off = buf->len;
+    buf_write(buf, s, strlen(s) + 1);
+    return off;
+}
+
+void buf_align(Buf *buf, int align)
+{
+    static char zero[16];
+    buf_write(buf, zero, (align - buf->len % align) % align);
+}
+
+void write_elf(FILE *out, unsigned char *text, int text_len, ObjSym *syms, ObjReloc *relocs)
+{
+    Buf strtab = {0};
+    Buf symtab = {0};
+    Buf rela = {0};
+    Buf shstrtab = {0};
+    buf_str(&strtab, "");
+    buf_str(&shstrtab, "");
+
+    // local symbols come first: the null symbol and the .text section
+    Elf64_Sym sym = {0};
+    buf_write(&symtab, &sym, sizeof(sym));
+    sym.st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION);
+    sym.st_shndx = SEC_TEXT;
+    buf_write(&symtab, &sym, sizeof(sym));
+    int first_global = 2;
+
+    int idx = first_global;
+    for (ObjSym *s = syms; s; s = s->next)
+    {
+        memset(&sym, 0, sizeof(sym));
+        sym.st_name = buf_str(&strtab, s->name);
+        if (s->defined)
+        {
+            sym.st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC);
+            sym.st_shndx = SEC_TEXT;
+            sym.st_value = s->offset;
+            sym.st_size = s->size;
+        }
+        else
+        {
+            sym.st_info = ELF64_ST_INFO(STB_GLOBAL, STT_NOTYPE);
+            sym.st_shndx = SHN_UNDEF;
+        }
+        buf_write(&symtab, &sym, sizeof(sym));
+        s->index = idx++;
+    }
+
+    for (ObjReloc *r = relocs; r; r = r->next)
+    {
+        Elf64_Rela rel = {0};
+        rel.r_offset = r->offset;
+        rel.r_info = ELF64_R_INFO(r->sym->index, r->type);
+        buf_write(&rela, &rel, sizeof(rel));
+    }
+
+    Elf64_Shdr sh[NUM_SECTIONS] = {0};
+    Buf body = {0};
+    Elf64_Ehdr eh = {0};
+    buf_write(&body, &eh, sizeof(eh));
+
+    sh[SEC_TEXT].sh_name = buf_str(&shstrtab, ".text");
+    sh[SEC_TEXT].sh_type = SHT_PROGBITS;
+    sh[SEC_TEXT].sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+    sh[SEC_TEXT].sh_addralign = 4;
+    buf_align(&body, 4);
+    sh[SEC_TEXT].sh_offset = body.len;
+    sh[SEC_TEXT].sh_size = text_len;
+    buf_write(&body, text, text_len);
+
+    sh[SEC_RELA_TEXT].sh_name = buf_str(&shstrtab, ".rela.text");
+    sh[SEC_RELA_TEXT].sh_type = SHT_RELA;
+    sh[SEC_RELA_TEXT].sh_flags = SHF_INFO_LINK;
+    sh[SEC_RELA_TEXT].sh_link = SEC_SYMTAB;
+    sh[SEC_RELA_TEXT].sh_info = SEC_TEXT;
+    sh[SEC_RELA_TEXT].sh_addralign = 8;
+    sh[SEC_RELA_TEXT].sh_entsize = sizeof(Elf64_Rela);
+    buf_align(&body, 8);
+    sh[SEC_RELA_TEXT].sh_offset = body.len;
+    sh[SEC_RELA_TEXT].sh_size = rela.len;
+    buf_write(&body, rela.data, rela.len);
+
+    sh[SEC_SYMTAB].sh_name = buf_str(&shstrtab, ".symtab");
+    sh[SEC_SYMTAB].sh_type = SHT_SYMTAB;
+    sh[SEC_SYMTAB].sh_link = SEC_STRTAB;
+    sh[SEC_SYMTAB].sh_info = first_global;
+    sh[SEC_SYMTAB].sh_addralign = 8;
+    sh[SEC_SYMTAB].sh_entsize = sizeof(Elf64_Sym);
+    buf_align(&body, 8);
+    sh[SEC_SYMTAB].sh_offset = body.len;
+    sh[SEC_SYMTAB].sh_size = symtab.len;
+    buf_write(&body, symtab.data, symtab.len);
+
+    sh[SEC_STRTAB].sh_name = buf_str(&shstrtab, ".strtab");
+    sh[SEC_STRTAB].sh_type = SHT_STRTAB;
+    sh[SEC_STRTAB].sh_addralign = 1;
+    sh[SEC_STRTAB].sh_offset = body.len;
+    sh[SEC_STRTAB].sh_size = strtab.len;
+    buf_write(&body, strtab.data, strtab.len);
+
+    // an empty .note.GNU-stack marks the stack as non-executable
+    sh[SEC_NOTE_STACK].sh_name = buf_str(&shstrtab, ".note.GNU-stack");
+    sh[SEC_NOTE_STACK].sh_type = SHT_PROGBITS;
+    sh[SEC_NOTE_STACK].sh_addralign = 1;
+    sh[SEC_NOTE_STACK].sh_offset = body.len;
+
+    sh[SEC_SHSTRTAB].sh_name = buf_str(&shstrtab, ".shstrtab");
+    sh[SEC_SHSTRTAB].sh_type = SHT_STRTAB;
+    sh[SEC_SHSTRTAB].sh_addralign = 1;
+    sh[SEC_SHSTRTAB].sh_offset = body.len;
+    sh[SEC_SHSTRTAB].sh_size = shstrtab.len;
+    buf_write(&body, shstrtab.data, shstrtab.len);
+
+    buf_align(&body, 8);
+    int shoff = body.len;
+    buf_write(&body, sh, sizeof(sh));
+
+    memcpy(eh.e_ident, ELFMAG, SELFMAG);
+    eh.e_ident[EI_CLASS] = ELFCLASS64;
+    eh.e_ident[EI_DATA] = ELFDATA2LSB;
+    eh.e_ident[EI_VERSION] = EV_CURRENT;
+    eh.e_ident[EI_OSABI] = ELFOSABI_NONE;
+    eh.e_type = ET_REL;
+    eh.e_machine = EM_AARCH64;
+    eh.e_version = EV_CURRENT;
+    eh.e_shoff = shoff;
+    eh.e_ehsize = sizeof(Elf64_Ehdr);
+    eh.e_shentsize = sizeof(Elf64_Shdr);
+    eh.e_shnum = NUM_SECTIONS;
+    eh.e_shstrndx = SEC_SHSTRTAB;
+    memcpy(body.data, &eh, sizeof(eh));
+
+    fwrite(body.data, 1, body.len, out);
+
+    free(strtab.data);
+    free(symtab.data);
+    free(rela.data);
+    free(shstrtab.data);
+    free(body.data);
+}
@@ -0,0 +1,545 @@
+#include "9cc.h"
+
+// Compile-time evaluation of calls to pure functions.
+//
+// A function is pure if it only touches its own parameters and locals
+// and only calls pure functions defined in the same program. A call to
+// a pure function whose arguments are all constants is evaluated here
+// and the ND_FUNCALL node is replaced with an ND_NUM holding the result.
+
+// maximum number of nodes evaluated for a single folded call
+#define STEP_BUDGET 100000
+// maximum depth of nested calls during evaluation
+#define DEPTH_LIMIT 256
+// number of buckets of the table of calls that failed to fold
+#define FAILED_BUCKETS 1024
+
+typedef enum
+{
+    EX_NORMAL, // statement completed
+    EX_RETURN, // "return" was executed
+    EX_FAIL,   // cannot be evaluated at compile time
+} ExecResult;
+
+// activation record of a function being evaluated.
+// slots are indexed by var->offset / 8.
+typedef struct EvalFrame EvalFrame;
+struct EvalFrame
+{
+    long *slots;
+    bool *init;
+};
+
+// caller of a function, for spreading impurity up the call graph
+typedef struct Caller Caller;
+struct Caller
+{
+    Caller *next;
+    Function *fn;
+};
+
+// a call that could not be evaluated. evaluation always starts with a
+// fresh budget, so the same call elsewhere would fail the same way.
+typedef struct FailedFold FailedFold;
+struct FailedFold
+{
+    FailedFold *next;
+    Function *fn;
+    int nargs;
+    long args[6];
+};
+
+_Thread_local Function *fold_prog;
+_Thread_local int fold_steps;
+_Thread_local int fold_depth;
+
+// functions of the program, indexed by interned name
+_Thread_local Function **func_table;
+_Thread_local int func_table_len;
+
+// callers of each function, indexed by interned name
+_Thread_local Caller **fold_callers;
+
+// hash table of the calls that could not be folded
+_Thread_local FailedFold **failed_folds;
+
+// builds the table find_func() looks names up in. it must be rebuilt
+// whenever a new program is compiled.
+void index_functions(Function *prog)
+{
+    free(func_table);
+    func_table_len = num_idents();
+    func_table = calloc(func_table_len + 1, sizeof(Function *));
+    for (Function *fn = prog; fn; fn = fn->next)
+    {
+        // like a linear search, the first definition wins
+        if (!func_table[fn->id])
+        {
+            func_table[fn->id] = fn;
+        }
+    }
+}
+
+// Find a function definition by interned name.
+Function *find_func(int id)
+{
+    return id < func_table_len ? func_table[id] : NULL;
+}
+
+int count_params(Function *fn)
+{
+    int n = 0;
+    for (VarList *vl = fn->params; vl; vl = vl->next)
+    {
+        n++;
+    }
+    return n;
+}
+
+int count_args(Node *node)
+{
+    int n = 0;
+    for (Node *arg = node->args; arg; arg = arg->next)
+    {
+        n++;
+    }
+    return n;
+}
+
+// returns true if the subtree (including the `next` chain) neither
+// takes addresses nor calls functions that are not defined here.
+// calls to functions defined here are recorded in fold_callers, since
+// whether those are pure is only known once every function is scanned.
+bool is_pure_node(Function *caller, Node *node)
+{
+    for (; node; node = node->next)
+    {
+        if (node->kind == ND_ADDR || node->kind == ND_DEREF)
+        {
+            return false;
+        }
+        if (node->kind == ND_FUNCALL)
+        {
+            Function *fn = find_func(node->funcid);
+            if (!fn || count_params(fn) != count_args(node))
+            {
+                return false;
+            }
+            Caller *c = calloc(1, sizeof(Caller));
+            c->fn = caller;
+            c->next = fold_callers[fn->id];
+            fold_callers[fn->id] = c;
+        }
+
+        if (!is_pure_node(caller, node->lhs) || !is_pure_node(caller, node->rhs) ||
+            !is_pure_node(caller, node->cond) || !is_pure_node(caller, node->then) ||
+            !is_pure_node(caller, node->els) || !is_pure_node(caller, node->init) ||
+            !is_pure_node(caller, node->inc) || !is_pure_node(caller, node->body) ||
+            !is_pure_node(caller, node->args))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// a function is impure if it does something impure itself or calls an
+// impure function. the functions found impure by themselves are put on
+// a worklist, and each function taken from it makes its callers
+// impure, so every function and call is visited once.
+void mark_pure_functions()
+{
+    int n = 0;
+    for (Function *fn = fold_prog; fn; fn = fn->next)
+    {
+        fn->is_pure = true;
+        n++;
+    }
+
+    fold_callers = calloc(func_table_len + 1, sizeof(Caller *));
+    Function **stack = calloc(n + 1, sizeof(Function *));
+    int sp = 0;
+    for (Function *fn = fold_prog; fn; fn = fn->next)
+    {
+        if (!is_pure_node(fn, fn->node))
+        {
+            fn->is_pure = false;
+            stack[sp++] = fn;
+        }
+    }
+
+    while (sp)
+    {
+        Function *fn = stack[--sp];
+        for (Caller *c = fold_callers[fn->id]; c; c = c->next)
+        {
+            if (c->fn->is_pure)
+            {
+                c->fn->is_pure = false;
+                stack[sp++] = c->fn;
+            }
+        }
+    }
+
+    for (int i = 0; i < func_table_len; i++)
+    {
+        while (fold_callers[i])
+        {
+            Caller *next = fold_callers[i]->next;
+            free(fold_callers[i]);
+            fold_callers[i] = next;
+        }
+    }
+    free(fold_callers);
+    free(stack);
+}
+
+bool eval_expr(Node *node, EvalFrame *f, long *val);
+
+bool eval_call(Function *fn, long *args, long *val);
+
+bool eval_funcall(Node *node, EvalFrame *f, long *val)
+{
+    Function *fn = find_func(node->funcid);
+    long args[6];
+    int nargs = 0;
+    for (Node *arg = node->args; arg; arg = arg->next)
+    {
+        if (nargs == 6 || !eval_expr(arg, f, &args[nargs++]))
+        {
+            return false;
+        }
+    }
+    return eval_call(fn, args, val);
+}
+
+// evaluates an expression. returns false if it cannot be
+// computed at compile time.
+bool eval_expr(Node *node, EvalFrame *f, long *val)
+{
+    if (++fold_steps > STEP_BUDGET)
+    {
+        return false;
+    }
+
+    switch (node->kind)
+    {
+    case ND_NUM:
+        *val = node->val;
+        return true;
+    case ND_VAR:
+    {
+        int i = node->var->offset / 8;
+        if (!f->init[i])
+        {
+            return false;
+        }
+        *val = f->slots[i];
+        return true;
+    }
+    case ND_ASSIGN:
+    {
+        if (node->lhs->kind != ND_VAR || !eval_expr(node->rhs, f, val))
+        {
+            return false;
+        }
+        int i = node->lhs->var->offset / 8;
+        f->slots[i] = *val;
+        f->init[i] = true;
+        return true;
+    }
+    case ND_FUNCALL:
+        return eval_funcall(node, f, val);
+    }
+
+    long lhs, rhs;
+    if (!node->lhs || !node->rhs || !eval_expr(node->lhs, f, &lhs) || !eval_expr(node->rhs, f, &rhs))
+    {
+        return false;
+    }
+
+    // wrap around like the 64-bit registers the generated code uses
+    switch (node->kind)
+    {
+    case ND_ADD:
+        *val = (long)((unsigned long)lhs + (unsigned long)rhs);
+        return true;
+    case ND_SUB:
+        *val = (long)((unsigned long)lhs - (unsigned long)rhs);
+        return true;
+    case ND_MUL:
+        *val = (long)((unsigned long)lhs * (unsigned long)rhs);
+        return true;
+    case ND_DIV:
+        if (rhs == 0 || (lhs == LONG_MIN && rhs == -1))
+        {
+            return false;
+        }
+        *val = lhs / rhs;
+        return true;
+    case ND_EQ:
+        *val = lhs == rhs;
+        return true;
+    case ND_NE:
+        *val = lhs != rhs;
+        return true;
+    case ND_LT:
+        *val = lhs < rhs;
+        return true;
+    case ND_LE:
+        *val = lhs <= rhs;
+        return true;
+    }
+    return false;
+}
+
+ExecResult eval_stmt(Node *node, EvalFrame *f, long *ret)
+{
+    if (++fold_steps > STEP_BUDGET)
+    {
+        return EX_FAIL;
+    }
+
+    long val;
+    switch (node->kind)
+    {
+    case ND_RETURN:
+        if (!eval_expr(node->lhs, f, ret))
+        {
+            return EX_FAIL;
+        }
+        return EX_RETURN;
+    case ND_EXPR_STMT:
+        return eval_expr(node->lhs, f, &val) ? EX_NORMAL : EX_FAIL;
+    case ND_BLOCK:
+        for (Node *n = node->body; n; n = n->next)
+        {
+            ExecResult res = eval_stmt(n, f, ret);
+            if (res != EX_NORMAL)
+            {
+                return res;
+            }
+        }
+        return EX_NORMAL;
+    case ND_IF:
+        if (!eval_expr(node->cond, f, &val))
+        {
+            return EX_FAIL;
+        }
+        if (val)
+        {
+            return eval_stmt(node->then, f, ret);
+        }
+        if (node->els)
+        {
+            return eval_stmt(node->els, f, ret);
+        }
+        return EX_NORMAL;
+    case ND_WHILE:
+    case ND_FOR:
+        if (node->init && eval_stmt(node->init, f, ret) != EX_NORMAL)
+        {
+            return EX_FAIL;
+        }
+        for (;;)
+        {
+            if (node->cond)
+            {
+                if (!eval_expr(node->cond, f, &val))
+                {
+                    return EX_FAIL;
+                }
+                if (!val)
+                {
+                    return EX_NORMAL;
+                }
+            }
+            ExecResult res = eval_stmt(node->then, f, ret);
+            if (res != EX_NORMAL)
+            {
+                return res;
+            }
+            if (node->inc && eval_stmt(node->inc, f, ret) != EX_NORMAL)
+            {
+                return EX_FAIL;
+            }
+        }
+    }
+
+    // a bare expression is not a statement in this language
+    return EX_FAIL;
+}
+
+bool eval_call(Function *fn, long *args, long *val)
+{
+    if (fold_depth == DEPTH_LIMIT)
+    {
+        return false;
+    }
+
+    int nslots = fn->stack_size / 8 + 1;
+    EvalFrame f;
+    f.slots = calloc(nslots, sizeof(long));
+    f.init = calloc(nslots, sizeof(bool));
+
+    int i = 0;
+    for (VarList *vl = fn->params; vl; vl = vl->next)
+    {
+        int j = vl->var->offset / 8;
+        f.slots[j] = args[i++];
+        f.init[j] = true;
+    }
+
+    fold_depth++;
+    ExecResult res = EX_NORMAL;
+    for (Node *n = fn->node; n && res == EX_NORMAL; n = n->next)
+    {
+        res = eval_stmt(n, &f, val);
+    }
+    fold_depth--;
+
+    free(f.slots);
+    free(f.init);
+
+    // falling off the end of a function yields no defined value
+    return res == EX_RETURN;
+}
+
+unsigned int hash_call(Function *fn, long *args, int nargs)
+{
+    unsigned long h = fn->id;
+    for (int i = 0; i < nargs; i++)
+    {
+        h = h * 31 + args[i];
+    }
+    return (h ^ h >> 32) % FAILED_BUCKETS;
+}
+
+FailedFold *find_failed_fold(Function *fn, long *args, int nargs)
+{
+    for (FailedFold *ff = failed_folds[hash_call(fn, args, nargs)]; ff; ff = ff->next)
+    {
+        if (ff->fn == fn && ff->nargs == nargs && !memcmp(ff->args, args, nargs * sizeof(long)))
+        {
+            return ff;
+        }
+    }
+    return NULL;
+}
+
+void add_failed_fold(Function *fn, long *args, int nargs)
+{
+    unsigned int h = hash_call(fn, args, nargs);
+    FailedFold *ff = calloc(1, sizeof(FailedFold));
+    ff->fn = fn;
+    ff->nargs = nargs;
+    memcpy(ff->args, args, nargs * sizeof(long));
+    ff->next = failed_folds[h];
+    failed_folds[h] = ff;
+}
+
+// returns true for arithmetic on integer literals, e.g. "0-1000".
+bool is_const_expr(Node *node)
+{
+    switch (node->kind)
+    {
+    case ND_NUM:
+        return true;
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+    case ND_DIV:
+    case ND_EQ:
+    case ND_NE:
+    case ND_LT:
+    case ND_LE:
+        return is_const_expr(node->lhs) && is_const_expr(node->rhs);
+    }
+    return false;
+}
+
+// replaces the call with its result if the callee is pure
+// and every argument is a constant.
+void fold_call(Node *node)
+{
+    Function *fn = find_func(node->funcid);
+    if (!fn || !fn->is_pure || count_params(fn) != count_args(node))
+    {
+        return;
+    }
+
+    EvalFrame empty = {0};
+    long args[6];
+    int nargs = 0;
+    fold_steps = 0;
+    fold_depth = 0;
+    for (Node *arg = node->args; arg; arg = arg->next)
+    {
+        if (nargs == 6 || !is_const_expr(arg) || !eval_expr(arg, &empty, &args[nargs++]))
+        {
+            return;
+        }
+    }
+
+    if (find_failed_fold(fn, args, nargs))
+    {
+        return;
+    }
+    long val;
+    if (!eval_call(fn, args, &val) || val < INT_MIN || INT_MAX < val)
+    {
+        add_failed_fold(fn, args, nargs);
+        return;
+    }
+
+    node->kind = ND_NUM;
+    node->val = val;
+    free_node(node->args);
+    node->args = NULL;
+}
+
+void fold_node(Node *node)
+{
+    for (; node; node = node->next)
+    {
+        fold_node(node->lhs);
+        fold_node(node->rhs);
+        fold_node(node->cond);
+        fold_node(node->then);
+        fold_node(node->els);
+        fold_node(node->init);
+        fold_node(node->inc);
+        fold_node(node->body);
+        fold_node(node->args);
+
+        if (node->kind == ND_FUNCALL)
+        {
+            fold_call(node);
+        }
+    }
+}
+
+// must run after stack layout since frames are indexed by var->offset.
+void fold_calls(Function *prog)
+{
+    fold_prog = prog;
+    mark_pure_functions();
+
+    failed_folds = calloc(FAILED_BUCKETS, sizeof(FailedFold *));
+    for (Function *fn = prog; fn; fn = fn->next)
+    {
+        fold_node(fn->node);
+    }
+
+    for (int i = 0; i < FAILED_BUCKETS; i++)
+    {
+        while (failed_folds[i])
+        {
+            FailedFold *next = failed_folds[i]->next;
+            free(failed_folds[i]);
+            failed_folds[i] = next;
+        }
+    }
+    free(failed_folds);
+    failed_folds = NULL;
+}
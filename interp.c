@@ -0,0 +1,650 @@
+#include "9cc.h"
+
+// Interpreter for the --run mode.
+//
+// Each function is lowered to a register-based bytecode and executed
+// by a threaded dispatch loop. The registers of a call live in one
+// frame of the VM stack: locals come first, laid out in the same order
+// as on the real stack so that pointer arithmetic between locals works
+// as in compiled code, followed by temporaries for expressions.
+
+typedef enum
+{
+    OP_IMM,     // r[a] = imm
+    OP_MOV,     // r[a] = r[b]
+    OP_ADD,     // r[a] = r[b] + r[c]
+    OP_SUB,     // r[a] = r[b] - r[c]
+    OP_MUL,     // r[a] = r[b] * r[c]
+    OP_DIV,     // r[a] = r[b] / r[c]
+    OP_EQ,      // r[a] = r[b] == r[c]
+    OP_NE,      // r[a] = r[b] != r[c]
+    OP_LT,      // r[a] = r[b] < r[c]
+    OP_LE,      // r[a] = r[b] <= r[c]
+    OP_ADDR,    // r[a] = &r[b]
+    OP_LOAD,    // r[a] = *r[b]
+    OP_STORE,   // *r[a] = r[b]
+    OP_JMP,     // goto b
+    OP_JZ,      // if (!r[a]) goto b
+    OP_JNZ,     // if (r[a]) goto b
+    OP_CALL,    // r[a] = funcs[b](r[c], ..., r[c+imm-1])
+    OP_BUILTIN, // r[a] = builtins[b](r[c], ...)
+    OP_RET,     // return r[a]
+} Opcode;
+
+typedef struct Insn Insn;
+struct Insn
+{
+    Opcode op;
+    int a;
+    int b;
+    int c;
+    long imm;
+};
+
+typedef struct BcFunc BcFunc;
+struct BcFunc
+{
+    Function *fn;
+    Insn *code;
+    int len;
+    int cap;
+    int nregs;   // locals + temporaries
+    int nlocals; // register slots reserved for locals
+};
+
+long builtin_putchar(long *args)
+{
+    return putchar(args[0]);
+}
+
+long builtin_getchar(long *args)
+{
+    return getchar();
+}
+
+long builtin_exit(long *args)
+{
+    fflush(stdout);
+    exit(args[0]);
+}
+
+Builtin builtins[] = {
+    {"putchar", 1, builtin_putchar},
+    {"getchar", 0, builtin_getchar},
+    {"exit", 1, builtin_exit},
+    {NULL},
+};
+
+BcFunc *bc_funcs;
+int bc_nfuncs;
+
+// lowering state of the current function
+BcFunc *bc_cur;
+int bc_ntemps;
+int *bc_labels;
+int bc_nlabels;
+
+#define VM_STACK_SIZE (1 << 20)
+
+int emit_insn(Opcode op, int a, int b, int c, long imm)
+{
+    if (bc_cur->len == bc_cur->cap)
+    {
+        bc_cur->cap = bc_cur->cap ? bc_cur->cap * 2 : 64;
+        bc_cur->code = realloc(bc_cur->code, bc_cur->cap * sizeof(Insn));
+    }
+
+    Insn *insn = &bc_cur->code[bc_cur->len];
+    insn->op = op;
+    insn->a = a;
+    insn->b = b;
+    insn->c = c;
+    insn->imm = imm;
+    return bc_cur->len++;
+}
+
+// labels are resolved to instruction indices once the function is done
+int new_label()
+{
+    bc_labels = realloc(bc_labels, (bc_nlabels + 1) * sizeof(int));
+    bc_labels[bc_nlabels] = -1;
+    return bc_nlabels++;
+}
+
+void bind_label(int label)
+{
+    bc_labels[label] = bc_cur->len;
+}
+
+int alloc_temp()
+{
+    int r = bc_cur->nlocals + bc_ntemps++;
+    if (bc_cur->nregs < r + 1)
+    {
+        bc_cur->nregs = r + 1;
+    }
+    return r;
+}
+
+int var_reg(Var *var)
+{
+    return bc_cur->nlocals - var->offset / 8;
+}
+
+int find_bcfunc(int id)
+{
+    for (int i = 0; i < bc_nfuncs; i++)
+    {
+        if (bc_funcs[i].fn->id == id)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int find_builtin(char *name)
+{
+    for (int i = 0; builtins[i].name; i++)
+    {
+        if (!strcmp(builtins[i].name, name))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// returns true if evaluating the node may write to a local.
+bool has_side_effects(Node *node)
+{
+    if (!node)
+    {
+        return false;
+    }
+    if (node->kind == ND_ASSIGN || node->kind == ND_FUNCALL)
+    {
+        return true;
+    }
+    return has_side_effects(node->lhs) || has_side_effects(node->rhs);
+}
+
+int lower_expr(Node *node);
+
+int lower_funcall(Node *node)
+{
+    int mark = bc_ntemps;
+    int nargs = 0;
+    for (Node *arg = node->args; arg; arg = arg->next)
+    {
+        alloc_temp();
+        nargs++;
+    }
+
+    // evaluate the arguments into consecutive registers
+    int base = bc_cur->nlocals + mark;
+    int i = 0;
+    for (Node *arg = node->args; arg; arg = arg->next)
+    {
+        int r = lower_expr(arg);
+        if (r != base + i)
+        {
+            emit_insn(OP_MOV, base + i, r, 0, 0);
+        }
+        bc_ntemps = mark + nargs;
+        i++;
+    }
+
+    bc_ntemps = mark;
+    int dst = alloc_temp();
+
+    int fn = find_bcfunc(node->funcid);
+    if (fn != -1)
+    {
+        int nparams = 0;
+        for (VarList *vl = bc_funcs[fn].fn->params; vl; vl = vl->next)
+        {
+            nparams++;
+        }
+        if (nparams != nargs)
+        {
+            error_tok(node->tok, "%s takes %d arguments", node->funcname, nparams);
+        }
+        emit_insn(OP_CALL, dst, fn, base, nargs);
+        return dst;
+    }
+
+    int bi = find_builtin(node->funcname);
+    if (bi == -1)
+    {
+        error_tok(node->tok, "undefined function: %s", node->funcname);
+    }
+    if (builtins[bi].nargs != nargs)
+    {
+        error_tok(node->tok, "%s takes %d arguments", node->funcname, builtins[bi].nargs);
+    }
+    emit_insn(OP_BUILTIN, dst, bi, base, nargs);
+    return dst;
+}
+
+// emits code for an expression and returns the register holding
+// its value. variables are used in place without copying.
+int lower_expr(Node *node)
+{
+    int mark = bc_ntemps;
+    switch (node->kind)
+    {
+    case ND_NUM:
+    {
+        int dst = alloc_temp();
+        emit_insn(OP_IMM, dst, 0, 0, node->val);
+        return dst;
+    }
+    case ND_VAR:
+        return var_reg(node->var);
+    case ND_ASSIGN:
+    {
+        if (node->lhs->kind == ND_VAR)
+        {
+            int dst = var_reg(node->lhs->var);
+            int r = lower_expr(node->rhs);
+            if (r != dst)
+            {
+                emit_insn(OP_MOV, dst, r, 0, 0);
+            }
+            bc_ntemps = mark;
+            return dst;
+        }
+        if (node->lhs->kind != ND_DEREF)
+        {
+            error_tok(node->tok, "not an lvalue");
+        }
+        int addr = lower_expr(node->lhs->lhs);
+        if (addr < bc_cur->nlocals && has_side_effects(node->rhs))
+        {
+            int tmp = alloc_temp();
+            emit_insn(OP_MOV, tmp, addr, 0, 0);
+            addr = tmp;
+        }
+        int val = lower_expr(node->rhs);
+        emit_insn(OP_STORE, addr, val, 0, 0);
+        return val;
+    }
+    case ND_ADDR:
+    {
+        if (node->lhs->kind == ND_DEREF)
+        {
+            return lower_expr(node->lhs->lhs);
+        }
+        if (node->lhs->kind != ND_VAR)
+        {
+            error_tok(node->tok, "not an lvalue");
+        }
+        int dst = alloc_temp();
+        emit_insn(OP_ADDR, dst, var_reg(node->lhs->var), 0, 0);
+        return dst;
+    }
+    case ND_DEREF:
+    {
+        int addr = lower_expr(node->lhs);
+        bc_ntemps = mark;
+        int dst = alloc_temp();
+        emit_insn(OP_LOAD, dst, addr, 0, 0);
+        return dst;
+    }
+    case ND_FUNCALL:
+        return lower_funcall(node);
+    }
+
+    int lhs = lower_expr(node->lhs);
+
+    // the right-hand side may overwrite a variable used on the left
+    if (lhs < bc_cur->nlocals && has_side_effects(node->rhs))
+    {
+        int tmp = alloc_temp();
+        emit_insn(OP_MOV, tmp, lhs, 0, 0);
+        lhs = tmp;
+    }
+
+    int rhs = lower_expr(node->rhs);
+    bc_ntemps = mark;
+    int dst = alloc_temp();
+
+    switch (node->kind)
+    {
+    case ND_ADD:
+        emit_insn(OP_ADD, dst, lhs, rhs, 0);
+        break;
+    case ND_SUB:
+        emit_insn(OP_SUB, dst, lhs, rhs, 0);
+        break;
+    case ND_MUL:
+        emit_insn(OP_MUL, dst, lhs, rhs, 0);
+        break;
+    case ND_DIV:
+        emit_insn(OP_DIV, dst, lhs, rhs, 0);
+        break;
+    case ND_EQ:
+        emit_insn(OP_EQ, dst, lhs, rhs, 0);
+        break;
+    case ND_NE:
+        emit_insn(OP_NE, dst, lhs, rhs, 0);
+        break;
+    case ND_LT:
+        emit_insn(OP_LT, dst, lhs, rhs, 0);
+        break;
+    case ND_LE:
+        emit_insn(OP_LE, dst, lhs, rhs, 0);
+        break;
+    default:
+        error_tok(node->tok, "invalid expression");
+    }
+    return dst;
+}
+
+void lower_stmt(Node *node)
+{
+    bc_ntemps = 0;
+
+    switch (node->kind)
+    {
+    case ND_RETURN:
+        emit_insn(OP_RET, lower_expr(node->lhs), 0, 0, 0);
+        return;
+    case ND_EXPR_STMT:
+        lower_expr(node->lhs);
+        return;
+    case ND_BLOCK:
+        for (Node *n = node->body; n; n = n->next)
+        {
+            lower_stmt(n);
+        }
+        return;
+    case ND_IF:
+    {
+        int lelse = new_label();
+        int lend = new_label();
+        emit_insn(OP_JZ, lower_expr(node->cond), lelse, 0, 0);
+        lower_stmt(node->then);
+        if (node->els)
+        {
+            emit_insn(OP_JMP, 0, lend, 0, 0);
+        }
+        bind_label(lelse);
+        if (node->els)
+        {
+            lower_stmt(node->els);
+        }
+        bind_label(lend);
+        return;
+    }
+    case ND_WHILE:
+    case ND_FOR:
+    {
+        // test at the bottom so each iteration takes a single jump
+        int lbody = new_label();
+        int lcond = new_label();
+        if (node->init)
+        {
+            lower_stmt(node->init);
+        }
+        emit_insn(OP_JMP, 0, lcond, 0, 0);
+        bind_label(lbody);
+        lower_stmt(node->then);
+        if (node->inc)
+        {
+            lower_stmt(node->inc);
+        }
+        bind_label(lcond);
+        bc_ntemps = 0;
+        if (node->cond)
+        {
+            emit_insn(OP_JNZ, lower_expr(node->cond), lbody, 0, 0);
+        }
+        else
+        {
+            emit_insn(OP_JMP, 0, lbody, 0, 0);
+        }
+        return;
+    }
+    }
+
+    error_tok(node->tok, "invalid statement");
+}
+
+void lower_function(BcFunc *bf)
+{
+    bc_cur = bf;
+    bc_nlabels = 0;
+    bf->nlocals = bf->fn->stack_size / 8;
+    bf->nregs = bf->nlocals;
+
+    for (Node *n = bf->fn->node; n; n = n->next)
+    {
+        lower_stmt(n);
+    }
+
+    // falling off the end returns 0
+    bc_ntemps = 0;
+    int r = alloc_temp();
+    emit_insn(OP_IMM, r, 0, 0, 0);
+    emit_insn(OP_RET, r, 0, 0, 0);
+
+    for (int i = 0; i < bf->len; i++)
+    {
+        Insn *insn = &bf->code[i];
+        if (insn->op == OP_JMP || insn->op == OP_JZ || insn->op == OP_JNZ)
+        {
+            insn->b = bc_labels[insn->b];
+        }
+    }
+}
+
+// a return address saved by OP_CALL
+typedef struct VmCall VmCall;
+struct VmCall
+{
+    BcFunc *fn;
+    Insn *pc;
+    long *regs;
+};
+
+long *vm_stack;
+long *vm_stack_end;
+
+// pointers may point anywhere between locals,
+// so the access is done bytewise.
+char *check_addr(long addr)
+{
+    char *p = (char *)addr;
+    if (p < (char *)vm_stack || (char *)vm_stack_end - sizeof(long) < p)
+    {
+        error("invalid memory access: %#lx", addr);
+    }
+    return p;
+}
+
+long vm_exec(BcFunc *entry)
+{
+    static void *dispatch[] = {
+        [OP_IMM] = &&op_imm,
+        [OP_MOV] = &&op_mov,
+        [OP_ADD] = &&op_add,
+        [OP_SUB] = &&op_sub,
+        [OP_MUL] = &&op_mul,
+        [OP_DIV] = &&op_div,
+        [OP_EQ] = &&op_eq,
+        [OP_NE] = &&op_ne,
+        [OP_LT] = &&op_lt,
+        [OP_LE] = &&op_le,
+        [OP_ADDR] = &&op_addr,
+        [OP_LOAD] = &&op_load,
+        [OP_STORE] = &&op_store,
+        [OP_JMP] = &&op_jmp,
+        [OP_JZ] = &&op_jz,
+        [OP_JNZ] = &&op_jnz,
+        [OP_CALL] = &&op_call,
+        [OP_BUILTIN] = &&op_builtin,
+        [OP_RET] = &&op_ret,
+    };
+
+#define NEXT() goto *dispatch[(++pc)->op]
+#define JUMP(target)             \
+    do                           \
+    {                            \
+        pc = fn->code + (target); \
+        goto *dispatch[pc->op];  \
+    } while (0)
+
+    VmCall *calls = calloc(VM_STACK_SIZE / 4, sizeof(VmCall));
+    VmCall *calls_end = calls + VM_STACK_SIZE / 4;
+    VmCall *sp = calls;
+
+    BcFunc *fn = entry;
+    Insn *pc = fn->code;
+    long *regs = vm_stack;
+    long *r = regs;
+    long ret;
+
+    goto *dispatch[pc->op];
+
+op_imm:
+    r[pc->a] = pc->imm;
+    NEXT();
+op_mov:
+    r[pc->a] = r[pc->b];
+    NEXT();
+op_add:
+    r[pc->a] = (unsigned long)r[pc->b] + (unsigned long)r[pc->c];
+    NEXT();
+op_sub:
+    r[pc->a] = (unsigned long)r[pc->b] - (unsigned long)r[pc->c];
+    NEXT();
+op_mul:
+    r[pc->a] = (unsigned long)r[pc->b] * (unsigned long)r[pc->c];
+    NEXT();
+op_div:
+    // sdiv yields 0 for a zero divisor
+    if (r[pc->c] == 0)
+        r[pc->a] = 0;
+    else if (r[pc->c] == -1)
+        r[pc->a] = -(unsigned long)r[pc->b];
+    else
+        r[pc->a] = r[pc->b] / r[pc->c];
+    NEXT();
+op_eq:
+    r[pc->a] = r[pc->b] == r[pc->c];
+    NEXT();
+op_ne:
+    r[pc->a] = r[pc->b] != r[pc->c];
+    NEXT();
+op_lt:
+    r[pc->a] = r[pc->b] < r[pc->c];
+    NEXT();
+op_le:
+    r[pc->a] = r[pc->b] <= r[pc->c];
+    NEXT();
+op_addr:
+    r[pc->a] = (long)&r[pc->b];
+    NEXT();
+op_load:
+    memcpy(&r[pc->a], check_addr(r[pc->b]), sizeof(long));
+    NEXT();
+op_store:
+    memcpy(check_addr(r[pc->a]), &r[pc->b], sizeof(long));
+    NEXT();
+op_jmp:
+    JUMP(pc->b);
+op_jz:
+    if (!r[pc->a])
+        JUMP(pc->b);
+    NEXT();
+op_jnz:
+    if (r[pc->a])
+        JUMP(pc->b);
+    NEXT();
+op_call:
+{
+    BcFunc *callee = &bc_funcs[pc->b];
+    long *next = r + fn->nregs;
+    if (sp == calls_end || vm_stack_end < next + callee->nregs)
+    {
+        error("stack overflow in %s", callee->fn->name);
+    }
+
+    // parameters are the first locals, so their registers
+    // are found from their stack offsets.
+    int i = 0;
+    for (VarList *vl = callee->fn->params; vl; vl = vl->next)
+    {
+        next[callee->nlocals - vl->var->offset / 8] = r[pc->c + i++];
+    }
+
+    sp->fn = fn;
+    sp->pc = pc;
+    sp->regs = r;
+    sp++;
+
+    fn = callee;
+    r = next;
+    pc = fn->code;
+    goto *dispatch[pc->op];
+}
+op_builtin:
+    r[pc->a] = builtins[pc->b].fn(&r[pc->c]);
+    NEXT();
+op_ret:
+    ret = r[pc->a];
+    if (sp == calls)
+    {
+        free(calls);
+        return ret;
+    }
+    sp--;
+    fn = sp->fn;
+    pc = sp->pc;
+    r = sp->regs;
+    r[pc->a] = ret;
+    NEXT();
+
+#undef NEXT
+#undef JUMP
+}
+
+// lowers every function and runs main(). returns its result.
+int run_program(Function *prog)
+{
+    bc_nfuncs = 0;
+    for (Function *fn = prog; fn; fn = fn->next)
+    {
+        bc_nfuncs++;
+    }
+    bc_funcs = calloc(bc_nfuncs, sizeof(BcFunc));
+    int i = 0;
+    for (Function *fn = prog; fn; fn = fn->next)
+    {
+        bc_funcs[i++].fn = fn;
+    }
+
+    for (i = 0; i < bc_nfuncs; i++)
+    {
+        lower_function(&bc_funcs[i]);
+    }
+
+    int entry = find_bcfunc(intern("main", 4));
+    if (entry == -1)
+    {
+        error("main is not defined");
+    }
+
+    vm_stack = calloc(VM_STACK_SIZE, sizeof(long));
+    vm_stack_end = vm_stack + VM_STACK_SIZE;
+    if (vm_stack_end < vm_stack + bc_funcs[entry].nregs)
+    {
+        error("stack overflow in main");
+    }
+
+    long ret = vm_exec(&bc_funcs[entry]);
+    fflush(stdout);
+    return ret;
+}
@@ -12,7 +12,7 @@ Node *mul();
 Node *unary();
 Node *primary();
 
-VarList *locals;
+_Thread_local VarList *locals;
 
 // Find a local variable by name.
 Var *find_var(Token *tok)
@@ -20,7 +20,7 @@ Var *find_var(Token *tok)
     for (VarList *vl = locals; vl; vl = vl->next)
     {
         Var *var = vl->var;
-        if (strlen(var->name) == tok->len && !memcmp(tok->str, var->name, tok->len))
+        if (var->id == tok->id)
         {
             return var;
         }
@@ -67,10 +67,11 @@ Node *new_var(Var *var, Token *tok)
     return node;
 }
 
-Var *push_var(char *name)
+Var *push_var(int id)
 {
     Var *var = calloc(1, sizeof(Var));
-    var->name = name;
+    var->id = id;
+    var->name = ident_name(id);
 
     VarList *vl = calloc(1, sizeof(VarList));
     vl->var = var;
@@ -133,7 +134,9 @@ Function *function()
     locals = NULL;
 
     Function *fn = calloc(1, sizeof(Function));
-    fn->name = expect_ident();
+    fn->tok = token;
+    fn->id = expect_ident();
+    fn->name = ident_name(fn->id);
     expect("(");
     fn->params = read_func_params();
     expect("{");
@@ -153,6 +156,64 @@ Function *function()
     return fn;
 }
 
+void free_node(Node *node)
+{
+    while (node)
+    {
+        Node *next = node->next;
+        free_node(node->lhs);
+        free_node(node->rhs);
+        free_node(node->cond);
+        free_node(node->then);
+        free_node(node->els);
+        free_node(node->init);
+        free_node(node->inc);
+        free_node(node->body);
+        free_node(node->args);
+        free(node);
+        node = next;
+    }
+}
+
+void free_var_list(VarList *vl, bool vars)
+{
+    while (vl)
+    {
+        VarList *next = vl->next;
+        if (vars)
+        {
+            free(vl->var);
+        }
+        free(vl);
+        vl = next;
+    }
+}
+
+// releases a function along with its AST and generated code.
+// every variable, including the parameters, is in `locals`.
+void free_function(Function *fn)
+{
+    free_node(fn->node);
+    free_var_list(fn->params, false);
+    free_var_list(fn->locals, true);
+
+    while (fn->callees)
+    {
+        CallEdge *next = fn->callees->next;
+        free(fn->callees);
+        fn->callees = next;
+    }
+    while (fn->calls)
+    {
+        CallSite *next = fn->calls->next;
+        free(fn->calls);
+        fn->calls = next;
+    }
+
+    free(fn->code);
+    free(fn);
+}
+
 // processes the following matching generation rule.
 //
 // stmt =
@@ -312,9 +373,9 @@ Node *add()
 
     for (;;)
     {
-        if (consume("+"))
+        if (tok = consume("+"))
             node = new_node_binary(ND_ADD, node, mul(), tok);
-        else if (consume("-"))
+        else if (tok = consume("-"))
             node = new_node_binary(ND_SUB, node, mul(), tok);
         else
             return node;
@@ -331,9 +392,9 @@ Node *mul()
 
     for (;;)
     {
-        if (consume("*"))
+        if (tok = consume("*"))
             node = new_node_binary(ND_MUL, node, unary(), tok);
-        else if (consume("/"))
+        else if (tok = consume("/"))
             node = new_node_binary(ND_DIV, node, unary(), tok);
         else
             return node;
@@ -398,7 +459,8 @@ Node *primary()
         if (consume("("))
         {
             Node *node = new_node(ND_FUNCALL, tok);
-            node->funcname = strndup(tok->str, tok->len);
+            node->funcid = tok->id;
+            node->funcname = ident_name(tok->id);
             node->args = func_args();
             return node;
         }
@@ -406,10 +468,11 @@ Node *primary()
         Var *var = find_var(tok);
         if (!var)
         {
-            var = push_var(strndup(tok->str, tok->len));
+            var = push_var(tok->id);
         }
         return new_var(var, tok);
     }
 
+    tok = token;
     return new_node_num(expect_number(), tok);
 }
@@ -0,0 +1,449 @@
+#include "9cc.h"
+#include <errno.h>
+
+// Profile-guided optimization.
+//
+// With --profile-generate=<file>, the generated code counts function
+// entries, the branches taken by if statements and loop back-edges,
+// and appends the counts to <file> when the program exits. Each line
+// is "<function> <counter> <seq> <count>", where seq is the label
+// number of the statement, so the counts of several runs, or of
+// several files linked together, add up.
+//
+// With --profile-use=<file>, the counts decide which branch of an if
+// statement falls through, which loops are rotated to test their
+// condition at the bottom, which calls are inlined and which functions
+// are placed together at the start of the text.
+
+// a function is hot if it is entered at least 1/HOT_RATIO times as
+// often as the most frequently entered function
+#define HOT_RATIO 10
+// maximum number of nodes in the return expression of an inlined
+// function
+#define INLINE_MAX_NODES 16
+
+typedef struct ProfileEntry ProfileEntry;
+struct ProfileEntry
+{
+    ProfileEntry *next; // in the same bucket
+    int func;           // interned function name
+    CounterKind kind;
+    int seq;
+    long count;
+};
+
+char *counter_names[] = {"entry", "then", "else", "loop"};
+
+char *profile_output; // file written by --profile-generate
+bool profile_loaded;  // a profile was read by --profile-use
+// hash table of the entries, keyed by function, counter and seq
+ProfileEntry **profile_buckets;
+int profile_nbuckets; // a power of two
+int profile_nentries;
+long profile_max_entry;
+
+unsigned int hash_profile_key(int func, CounterKind kind, int seq)
+{
+    return ((unsigned int)func * 31 + kind) * 2654435761u + seq;
+}
+
+ProfileEntry *find_profile_entry(int func, CounterKind kind, int seq)
+{
+    if (!profile_nbuckets)
+    {
+        return NULL;
+    }
+    unsigned int i = hash_profile_key(func, kind, seq) & (profile_nbuckets - 1);
+    for (ProfileEntry *e = profile_buckets[i]; e; e = e->next)
+    {
+        if (e->kind == kind && e->seq == seq && e->func == func)
+        {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+long profile_count(int func, CounterKind kind, int seq)
+{
+    ProfileEntry *e = find_profile_entry(func, kind, seq);
+    return e ? e->count : 0;
+}
+
+void add_profile_entry(ProfileEntry *e)
+{
+    // keep at most one entry per bucket on average
+    if (profile_nentries >= profile_nbuckets)
+    {
+        ProfileEntry **old = profile_buckets;
+        int old_n = profile_nbuckets;
+        profile_nbuckets = profile_nbuckets ? profile_nbuckets * 2 : 1024;
+        profile_buckets = calloc(profile_nbuckets, sizeof(ProfileEntry *));
+        for (int i = 0; i < old_n; i++)
+        {
+            for (ProfileEntry *p = old[i], *next; p; p = next)
+            {
+                next = p->next;
+                unsigned int j = hash_profile_key(p->func, p->kind, p->seq) & (profile_nbuckets - 1);
+                p->next = profile_buckets[j];
+                profile_buckets[j] = p;
+            }
+        }
+        free(old);
+    }
+
+    unsigned int i = hash_profile_key(e->func, e->kind, e->seq) & (profile_nbuckets - 1);
+    e->next = profile_buckets[i];
+    profile_buckets[i] = e;
+    profile_nentries++;
+}
+
+void profile_load(char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+    {
+        error("cannot open %s: %s", path, strerror(errno));
+    }
+
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    for (int lineno = 1; (len = getline(&line, &cap, fp)) != -1; lineno++)
+    {
+        char *name = malloc(len + 1);
+        char *kind = malloc(len + 1);
+        int seq;
+        long count;
+        if (sscanf(line, "%s %s %d %ld", name, kind, &seq, &count) != 4)
+        {
+            error("%s:%d: malformed profile line", path, lineno);
+        }
+
+        int k = 0;
+        while (k < sizeof(counter_names) / sizeof(*counter_names) && strcmp(counter_names[k], kind))
+        {
+            k++;
+        }
+        if (k == sizeof(counter_names) / sizeof(*counter_names))
+        {
+            error("%s:%d: unknown counter '%s'", path, lineno, kind);
+        }
+        free(kind);
+        int func = intern(name, strlen(name));
+        free(name);
+
+        // counts of several runs add up
+        ProfileEntry *e = find_profile_entry(func, k, seq);
+        if (!e)
+        {
+            e = calloc(1, sizeof(ProfileEntry));
+            e->func = func;
+            e->kind = k;
+            e->seq = seq;
+            add_profile_entry(e);
+        }
+        e->count += count;
+
+        if (e->kind == PC_ENTRY && profile_max_entry < e->count)
+        {
+            profile_max_entry = e->count;
+        }
+    }
+    free(line);
+    fclose(fp);
+    profile_loaded = true;
+}
+
+// returns true if the else branch of the if statement numbered seq
+// ran more often than the then branch.
+bool profile_prefers_else(Function *fn, int seq)
+{
+    if (!profile_loaded)
+    {
+        return false;
+    }
+    return profile_count(fn->id, PC_ELSE, seq) > profile_count(fn->id, PC_THEN, seq);
+}
+
+// returns true if the loop numbered seq usually runs more than once
+// each time the function is entered, so that testing the condition at
+// the bottom saves a jump per iteration.
+bool profile_rotates_loop(Function *fn, int seq)
+{
+    if (!profile_loaded)
+    {
+        return false;
+    }
+    return profile_count(fn->id, PC_LOOP, seq) > profile_count(fn->id, PC_ENTRY, 0);
+}
+
+bool is_hot(Function *fn)
+{
+    long count = profile_count(fn->id, PC_ENTRY, 0);
+    return count > 0 && count * HOT_RATIO >= profile_max_entry;
+}
+
+bool is_param(Function *fn, Var *var)
+{
+    for (VarList *vl = fn->params; vl; vl = vl->next)
+    {
+        if (vl->var == var)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// counts the nodes of an expression that can be inlined: arithmetic
+// and loads on parameters and numbers. returns -1 for anything else,
+// such as assignments, calls or taking the address of a parameter.
+int inline_size(Function *fn, Node *node)
+{
+    switch (node->kind)
+    {
+    case ND_NUM:
+        return 1;
+    case ND_VAR:
+        return is_param(fn, node->var) ? 1 : -1;
+    case ND_DEREF:
+    {
+        int n = inline_size(fn, node->lhs);
+        return n < 0 ? -1 : n + 1;
+    }
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+    case ND_DIV:
+    case ND_EQ:
+    case ND_NE:
+    case ND_LT:
+    case ND_LE:
+    {
+        int l = inline_size(fn, node->lhs);
+        int r = inline_size(fn, node->rhs);
+        return l < 0 || r < 0 ? -1 : l + r + 1;
+    }
+    }
+    return -1;
+}
+
+// a function can be inlined if its body is a single small return
+// statement. such a function neither writes memory nor calls anything.
+bool is_inlinable(Function *fn)
+{
+    Node *node = fn->node;
+    if (!node || node->next || node->kind != ND_RETURN)
+    {
+        return false;
+    }
+    int n = inline_size(fn, node->lhs);
+    return 0 < n && n <= INLINE_MAX_NODES;
+}
+
+// returns true if evaluating the argument has no side effects, so it
+// may be moved into the inlined expression, duplicated or dropped.
+bool is_simple_arg(Node *node)
+{
+    switch (node->kind)
+    {
+    case ND_NUM:
+    case ND_VAR:
+        return true;
+    case ND_ADDR:
+        return node->lhs->kind == ND_VAR;
+    case ND_DEREF:
+        return is_simple_arg(node->lhs);
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+    case ND_DIV:
+    case ND_EQ:
+    case ND_NE:
+    case ND_LT:
+    case ND_LE:
+        return is_simple_arg(node->lhs) && is_simple_arg(node->rhs);
+    }
+    return false;
+}
+
+Node *copy_expr(Node *node)
+{
+    Node *copy = calloc(1, sizeof(Node));
+    copy->kind = node->kind;
+    copy->tok = node->tok;
+    copy->val = node->val;
+    copy->var = node->var;
+    if (node->lhs)
+    {
+        copy->lhs = copy_expr(node->lhs);
+    }
+    if (node->rhs)
+    {
+        copy->rhs = copy_expr(node->rhs);
+    }
+    return copy;
+}
+
+// copies the return expression of fn, replacing its parameters with
+// copies of the arguments of the call. the copy takes the token of
+// the call, so that line info points at the call site.
+Node *inline_expr(Function *fn, Node *node, Node *call)
+{
+    if (node->kind == ND_VAR)
+    {
+        Node *arg = call->args;
+        for (VarList *vl = fn->params; vl->var != node->var; vl = vl->next)
+        {
+            arg = arg->next;
+        }
+        return copy_expr(arg);
+    }
+
+    Node *copy = calloc(1, sizeof(Node));
+    copy->kind = node->kind;
+    copy->tok = call->tok;
+    copy->val = node->val;
+    if (node->lhs)
+    {
+        copy->lhs = inline_expr(fn, node->lhs, call);
+    }
+    if (node->rhs)
+    {
+        copy->rhs = inline_expr(fn, node->rhs, call);
+    }
+    return copy;
+}
+
+void inline_call(Function *prog, Node *node)
+{
+    Function *fn = find_func(node->funcid);
+    if (!fn || !is_hot(fn) || !is_inlinable(fn) || count_params(fn) != count_args(node))
+    {
+        return;
+    }
+    for (Node *arg = node->args; arg; arg = arg->next)
+    {
+        if (!is_simple_arg(arg))
+        {
+            return;
+        }
+    }
+
+    // the call node becomes the root of the copy, keeping its
+    // place in the `next` chain
+    Node *expr = inline_expr(fn, fn->node->lhs, node);
+    free_node(node->args);
+    node->kind = expr->kind;
+    node->tok = expr->tok;
+    node->val = expr->val;
+    node->var = expr->var;
+    node->lhs = expr->lhs;
+    node->rhs = expr->rhs;
+    node->funcname = NULL;
+    node->args = NULL;
+    free(expr);
+}
+
+void inline_node(Function *prog, Node *node)
+{
+    for (; node; node = node->next)
+    {
+        inline_node(prog, node->lhs);
+        inline_node(prog, node->rhs);
+        inline_node(prog, node->cond);
+        inline_node(prog, node->then);
+        inline_node(prog, node->els);
+        inline_node(prog, node->init);
+        inline_node(prog, node->inc);
+        inline_node(prog, node->body);
+        inline_node(prog, node->args);
+
+        if (node->kind == ND_FUNCALL)
+        {
+            inline_call(prog, node);
+        }
+    }
+}
+
+// replaces calls of hot functions that just return an expression of
+// their parameters with that expression. the function itself is only
+// dropped if --entry is given and no calls to it are left.
+void inline_hot_calls(Function *prog)
+{
+    if (!profile_loaded)
+    {
+        return;
+    }
+    for (Function *fn = prog; fn; fn = fn->next)
+    {
+        inline_node(prog, fn->node);
+    }
+}
+
+typedef struct HotFunction HotFunction;
+struct HotFunction
+{
+    Function *fn;
+    long count;
+    int index; // position in the program, to keep the sort stable
+};
+
+int compare_hot(const void *a, const void *b)
+{
+    const HotFunction *x = a;
+    const HotFunction *y = b;
+    if (x->count != y->count)
+    {
+        return x->count < y->count ? 1 : -1;
+    }
+    return x->index - y->index;
+}
+
+// moves the hot functions to the front, most frequently entered
+// first, so that the code run most often shares pages and cache
+// lines. the other functions keep their order.
+Function *group_hot_functions(Function *prog)
+{
+    if (!profile_loaded)
+    {
+        return prog;
+    }
+
+    int n = 0;
+    for (Function *fn = prog; fn; fn = fn->next)
+    {
+        n++;
+    }
+    HotFunction *hot = calloc(n + 1, sizeof(HotFunction));
+    int nhot = 0;
+    Function cold_head = {0};
+    Function *cold = &cold_head;
+    int index = 0;
+    for (Function *fn = prog; fn; fn = fn->next, index++)
+    {
+        if (is_hot(fn))
+        {
+            hot[nhot++] = (HotFunction){fn, profile_count(fn->id, PC_ENTRY, 0), index};
+        }
+        else
+        {
+            cold->next = fn;
+            cold = fn;
+        }
+    }
+    cold->next = NULL;
+    qsort(hot, nhot, sizeof(HotFunction), compare_hot);
+
+    Function head = {0};
+    Function *tail = &head;
+    for (int i = 0; i < nhot; i++)
+    {
+        tail->next = hot[i].fn;
+        tail = hot[i].fn;
+    }
+    tail->next = cold_head.next;
+    free(hot);
+    return head.next;
+}
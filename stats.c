@@ -0,0 +1,226 @@
+#include "9cc.h"
+#include <malloc.h>
+#include <time.h>
+
+// Compiler statistics printed by --stats.
+//
+// Each phase accumulates wall and CPU time and the growth of the heap
+// while it runs, so phases that run once per function, as in --stream,
+// add up to a total for the whole input. The growth is that of the main
+// arena: it is negative when a phase frees more than it allocates, and
+// it leaves out what -j worker threads allocate in their own arenas.
+
+typedef struct PhaseStats PhaseStats;
+struct PhaseStats
+{
+    double wall; // seconds
+    double cpu;  // seconds, summed over all threads
+    long heap_growth; // bytes, net change of the main arena
+
+    struct timespec wall_start;
+    struct timespec cpu_start;
+    long heap_start;
+};
+
+typedef struct FuncStats FuncStats;
+struct FuncStats
+{
+    FuncStats *next;
+    char *name;
+    int nodes;
+    int locals;
+    int insns; // -1 if the backend does not count them
+};
+
+char *phase_names[] = {"tokenize", "parse", "layout", "optimize", "codegen"};
+
+bool stats_enabled;
+PhaseStats phases[NUM_PHASES];
+long stats_tokens;
+long stats_cache_hits; // functions taken from the cache by --stream
+FuncStats *stats_funcs;
+FuncStats *stats_funcs_last;
+
+// bytes in use in the heap, including large blocks that malloc maps
+// directly. only the main arena is counted, which is the one used by
+// the main thread.
+long heap_in_use()
+{
+#if __GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 mi = mallinfo2();
+#else
+    struct mallinfo mi = mallinfo();
+#endif
+    return mi.uordblks + mi.hblkhd;
+}
+
+double seconds_since(struct timespec *start, clockid_t clock)
+{
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void phase_begin(Phase ph)
+{
+    if (!stats_enabled)
+    {
+        return;
+    }
+    PhaseStats *ps = &phases[ph];
+    ps->heap_start = heap_in_use();
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ps->cpu_start);
+    clock_gettime(CLOCK_MONOTONIC, &ps->wall_start);
+}
+
+void phase_end(Phase ph)
+{
+    if (!stats_enabled)
+    {
+        return;
+    }
+    PhaseStats *ps = &phases[ph];
+    ps->wall += seconds_since(&ps->wall_start, CLOCK_MONOTONIC);
+    ps->cpu += seconds_since(&ps->cpu_start, CLOCK_PROCESS_CPUTIME_ID);
+    ps->heap_growth += heap_in_use() - ps->heap_start;
+}
+
+void count_tokens(Token *tok)
+{
+    if (!stats_enabled)
+    {
+        return;
+    }
+    for (; tok && tok->kind != TK_EOF; tok = tok->next)
+    {
+        stats_tokens++;
+    }
+}
+
+int count_nodes(Node *node)
+{
+    int n = 0;
+    for (; node; node = node->next)
+    {
+        n += 1 + count_nodes(node->lhs) + count_nodes(node->rhs) +
+             count_nodes(node->cond) + count_nodes(node->then) +
+             count_nodes(node->els) + count_nodes(node->init) +
+             count_nodes(node->inc) + count_nodes(node->body) +
+             count_nodes(node->args);
+    }
+    return n;
+}
+
+// records the functions of prog once their code has been generated.
+// insns tells whether the backend counted their instructions.
+void count_functions(Function *prog, bool insns)
+{
+    if (!stats_enabled)
+    {
+        return;
+    }
+    for (Function *fn = prog; fn; fn = fn->next)
+    {
+        FuncStats *fs = calloc(1, sizeof(FuncStats));
+        fs->name = fn->name;
+        fs->nodes = count_nodes(fn->node);
+        for (VarList *vl = fn->locals; vl; vl = vl->next)
+        {
+            fs->locals++;
+        }
+        fs->insns = insns ? fn->insn_count : -1;
+
+        if (stats_funcs_last)
+        {
+            stats_funcs_last->next = fs;
+        }
+        else
+        {
+            stats_funcs = fs;
+        }
+        stats_funcs_last = fs;
+    }
+}
+
+// counts a function whose code was taken from the cache. such
+// functions are not parsed, so they are not in the function table.
+void count_cache_hit()
+{
+    if (stats_enabled)
+    {
+        stats_cache_hits++;
+    }
+}
+
+void print_stats_text(FILE *out, int nfuncs, long nodes, long locals)
+{
+    fprintf(out, "%-10s %10s %10s %12s\n", "phase", "wall ms", "cpu ms", "heap growth");
+    for (int i = 0; i < NUM_PHASES; i++)
+    {
+        fprintf(out, "%-10s %10.3f %10.3f %12ld\n", phase_names[i],
+                phases[i].wall * 1e3, phases[i].cpu * 1e3, phases[i].heap_growth);
+    }
+    fprintf(out, "(heap growth is of the main arena and excludes worker threads)\n");
+    fprintf(out, "\ntokens %ld, nodes %ld, locals %ld, functions %d, cache hits %ld\n\n",
+            stats_tokens, nodes, locals, nfuncs, stats_cache_hits);
+
+    fprintf(out, "%-20s %8s %8s %8s\n", "function", "nodes", "locals", "insns");
+    for (FuncStats *fs = stats_funcs; fs; fs = fs->next)
+    {
+        if (fs->insns < 0)
+        {
+            fprintf(out, "%-20s %8d %8d %8s\n", fs->name, fs->nodes, fs->locals, "-");
+        }
+        else
+        {
+            fprintf(out, "%-20s %8d %8d %8d\n", fs->name, fs->nodes, fs->locals, fs->insns);
+        }
+    }
+}
+
+void print_stats_json(FILE *out, int nfuncs, long nodes, long locals)
+{
+    fprintf(out, "{\"phases\": {");
+    for (int i = 0; i < NUM_PHASES; i++)
+    {
+        fprintf(out, "%s\"%s\": {\"wall_ms\": %.3f, \"cpu_ms\": %.3f, \"heap_growth\": %ld}",
+                i ? ", " : "", phase_names[i], phases[i].wall * 1e3, phases[i].cpu * 1e3, phases[i].heap_growth);
+    }
+    fprintf(out, "}, \"tokens\": %ld, \"nodes\": %ld, \"locals\": %ld, \"function_count\": %d, "
+                 "\"cache_hits\": %ld, \"functions\": [",
+            stats_tokens, nodes, locals, nfuncs, stats_cache_hits);
+    for (FuncStats *fs = stats_funcs; fs; fs = fs->next)
+    {
+        fprintf(out, "%s{\"name\": \"%s\", \"nodes\": %d, \"locals\": %d",
+                fs == stats_funcs ? "" : ", ", fs->name, fs->nodes, fs->locals);
+        // left out for backends that do not count instructions
+        if (fs->insns >= 0)
+        {
+            fprintf(out, ", \"insns\": %d", fs->insns);
+        }
+        fprintf(out, "}");
+    }
+    fprintf(out, "]}\n");
+}
+
+void print_stats(FILE *out, bool json)
+{
+    int nfuncs = 0;
+    long nodes = 0;
+    long locals = 0;
+    for (FuncStats *fs = stats_funcs; fs; fs = fs->next)
+    {
+        nfuncs++;
+        nodes += fs->nodes;
+        locals += fs->locals;
+    }
+
+    if (json)
+    {
+        print_stats_json(out, nfuncs, nodes, locals);
+    }
+    else
+    {
+        print_stats_text(out, nfuncs, nodes, locals);
+    }
+}
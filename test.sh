@@ -13,8 +13,9 @@ EOF
 assert() {
   expected="$1"
   input="$2"
+  flags="$3"
 
-  ./9cc "$input" > tmp.s
+  ./9cc $flags "$input" > tmp.s
   cc -o tmp tmp.s tmp2.o
   ./tmp
   actual="$?"
@@ -27,6 +28,39 @@ assert() {
   fi
 }
 
+assert_obj() {
+  expected="$1"
+  input="$2"
+
+  ./9cc -c "$input" > tmp.o
+  cc -o tmp tmp.o tmp2.o
+  ./tmp
+  actual="$?"
+
+  if [ "$actual" = "$expected" ]; then
+    echo "-c $input => $actual"
+  else
+    echo "-c $input => $expected expected, but got $actual"
+    exit 1
+  fi
+}
+
+assert_run() {
+  expected="$1"
+  input="$2"
+  mode="${3:---run}"
+
+  ./9cc $mode "$input" > /dev/null
+  actual="$?"
+
+  if [ "$actual" = "$expected" ]; then
+    echo "$mode $input => $actual"
+  else
+    echo "$mode $input => $expected expected, but got $actual"
+    exit 1
+  fi
+}
+
 assert 0 'main() { return 0; }'
 assert 42 'main() { return 42; }'
 assert 21 'main() { return 5+20-4; }'
@@ -66,6 +100,7 @@ assert 3 'main() { 1; 2; return 3; }'
 
 assert 3 'main() { foo=3; return foo; }'
 assert 8 'main() { foo123=3; bar=5; return foo123+bar; }'
+assert 13 'main() { fo=1; foo=3; foobar=4; return foo*foobar+f(fo); } f(f) { return f; }'
 
 assert 3 'main() { if (0) return 2; return 3; }'
 assert 3 'main() { if (1-1) return 2; return 3; }'
@@ -89,6 +124,35 @@ assert 21 'main() { return add6(1,2,3,4,5,6); }'
 assert 32 'main() { return ret32(); } ret32() { return 32; }'
 assert 7 'main() { return add2(3,4); } add2(x,y) { return x+y; }'
 assert 1 'main() { return sub2(4,3); } sub2(x,y) { return x-y; }'
+assert 55 'main() { return fib(10); } fib(n) { if (n<2) return n; return fib(n-1)+fib(n-2); }'
+assert 55 'main() { return sum(10); } sum(n) { s=0; for (i=1; i<=n; i=i+1) s=s+i; return s; }'
+assert 6 'main() { return mul2(0-2,0-3); } mul2(x,y) { return x*y; }'
+assert 3 'main() { return deref(3); } deref(x) { y=&x; return *y; }'
+
+fib='main() { return fib(10); } fib(n) { if (n<2) return n; return fib(n-1)+fib(n-2); }'
+if ./9cc "$fib" | sed -n '/^main:/,/^\.size main/p' | grep -q 'bl fib'; then
+  echo "$fib => fib(10) not folded"; exit 1
+fi
+echo "$fib => folded"
+
+assert 3 'main() { return 3; } dead() { return undefined(); }' --entry=main
+assert 8 'leaf(x) { return ret5()+x; } main() { return mid(3); } mid(x) { y=&x; return leaf(*y); }' --entry=main
+
+chain='leaf(x) { return x+ret3(); } mid(x) { return leaf(x)+ret3(); } main() { return mid(ret5()); } dead() { return 0; }'
+dot=$(./9cc --dump-callgraph --entry=main "$chain")
+case "$dot" in
+  *'"dead" [style=dashed];'*'"mid" -> "leaf" [label=1];'*'"main" -> "mid" [label=1];'*) ;;
+  *) echo "--dump-callgraph => unexpected output: $dot"; exit 1 ;;
+esac
+if [ "$(echo "$dot" | grep -c '"ret3" \[shape=box\]')" != 1 ]; then
+  echo "--dump-callgraph => ret3 not declared once: $dot"; exit 1
+fi
+echo "--dump-callgraph => OK"
+order=$(./9cc --entry=main "$chain" | grep '^[a-z]*:' | tr -d '\n')
+if [ "$order" != 'main:mid:leaf:' ]; then
+  echo "--entry=main layout => $order"; exit 1
+fi
+echo "--entry=main layout => $order"
 
 assert 3 'main() { x=3; return *&x; }'
 assert 3 'main() { x=3; y=&x; z=&y; return **z; }'
@@ -99,4 +163,121 @@ assert 3 'main() { x=3; y=5; return *(&y-16); }'
 # assert 7 'main() { x=3; y=5; *(&x+8)=7; return y; }'
 assert 7 'main() { x=3; y=5; *(&y-16)=7; return x; }'
 
+assert 55 'main() { return fib(10); } fib(n) { if (n<2) return n; return fib(n-1)+fib(n-2); }' -j4
+assert 13 'main() { return f(1)+g(2); } f(x) { while (x<5) x=x+1; return x; } g(x) { if (x) return 8; return 0; }' -j2
+
+assert 21 'main() { return add2(fib(7),8); } add2(x,y) { return x+y; } fib(n) { if (n<2) return n; return fib(n-1)+fib(n-2); }' --stream
+assert 8 'main() { { x=ret3(); } return x+ret5(); }' --stream
+
+rm -rf tmp.cache
+assert 10 'main() { return twice(5); } twice(x) { return x+x; }' '--stream --cache=tmp.cache'
+assert 10 'main() { return twice(5); } twice(x) { return x+x; }' '--stream --cache=tmp.cache'
+assert 15 'main() { return twice(5); } twice(x) { return x+x+x; }' '--stream --cache=tmp.cache'
+
+printf 'main() {\n  return add2(4, 5);\n}\nadd2(x, y) { return x+y; }\n' > tmp.c
+assert 9 tmp.c
+assert 9 - < tmp.c
+case "$(./9cc tmp.c)" in
+  *'.file 1 "tmp.c"'*'.loc 1 2 3'*'.size main, .-main'*) echo "tmp.c line info => OK" ;;
+  *) echo "tmp.c line info => missing"; exit 1 ;;
+esac
+
+# entries are reused when lines are inserted above, with line info moved
+rm -rf tmp.cache
+./9cc --stream --cache=tmp.cache tmp.c > /dev/null || exit 1
+entries=$(ls tmp.cache | wc -l)
+(echo; cat tmp.c) > tmp-shift.c
+case "$(./9cc --stream --cache=tmp.cache tmp-shift.c)" in
+  *'.file 1 "tmp-shift.c"'*'.loc 1 3 3'*'.loc 1 5 1'*) ;;
+  *) echo "tmp-shift.c cached line info => wrong"; exit 1 ;;
+esac
+if [ "$(ls tmp.cache | wc -l)" != "$entries" ]; then
+  echo "tmp-shift.c => cache missed"; exit 1
+fi
+echo "tmp-shift.c cached line info => OK"
+
+rm -f tmp.prof
+prof='main() { s=0; for (i=0; i<10; i=i+1) if (i<2) s=s+1; else s=s+twice(i); return s; } twice(x) { return x+x; }'
+assert 90 "$prof" --profile-generate=tmp.prof
+if grep -q '^main entry 0 1$' tmp.prof && grep -q '^main else [0-9]* 8$' tmp.prof && grep -q '^twice entry 0 8$' tmp.prof; then
+  echo "tmp.prof => OK"
+else
+  echo "tmp.prof => unexpected counts"; exit 1
+fi
+assert 90 "$prof" --profile-use=tmp.prof
+case "$(./9cc --profile-use=tmp.prof "$prof")" in
+  *'b .Lcond.main.0'*'cbnz x0, .Lbegin.main.0'*) echo "tmp.prof loop rotation => OK" ;;
+  *) echo "tmp.prof loop rotation => missing"; exit 1 ;;
+esac
+
+printf 'main() { return 3; }\0main() { return add(2, 4); }\0' > tmp.in
+./9cc --batch -o tmp.batch tmp.in || exit 1
+for t in 0:3 1:6; do
+  cc -o tmp tmp.batch/${t%:*}.s tmp2.o
+  ./tmp
+  actual="$?"
+  if [ "$actual" != "${t#*:}" ]; then
+    echo "--batch tmp.batch/${t%:*}.s => ${t#*:} expected, but got $actual"
+    exit 1
+  fi
+done
+if grep -q '\.file\|\.loc' tmp.batch/0.s; then
+  echo "--batch tmp.batch/0.s => unexpected line info"; exit 1
+fi
+echo "--batch tmp.in => OK"
+
+# an error in a codegen thread fails its program, not the batch
+printf 'main() { 3=1; return f(); } f() { return 1; }\0main() { return 6; }\0' > tmp.in
+rm -rf tmp.batch
+if ./9cc --batch -j2 -o tmp.batch tmp.in 2>/dev/null || [ ! -f tmp.batch/1.s ]; then
+  echo "--batch -j2 tmp.in => error not contained"; exit 1
+fi
+cc -o tmp tmp.batch/1.s tmp2.o
+./tmp
+actual="$?"
+if [ "$actual" != 6 ]; then
+  echo "--batch -j2 tmp.batch/1.s => 6 expected, but got $actual"; exit 1
+fi
+echo "--batch -j2 tmp.in => OK"
+
+echo 'main() { return twice(add(2, 3)); }' > tmp-main.c
+echo 'twice(x) { return x*2; }' > tmp-twice.c
+./9cc -j2 tmp-main.c tmp-twice.c || exit 1
+cc -o tmp tmp-main.s tmp-twice.s tmp2.o
+./tmp
+actual="$?"
+if [ "$actual" != 10 ]; then
+  echo "-j2 tmp-main.c tmp-twice.c => 10 expected, but got $actual"
+  exit 1
+fi
+echo "-j2 tmp-main.c tmp-twice.c => $actual"
+
+stats=$(./9cc --stats=json 'main() { return f(1); } f(x) { return x; }' 2>&1 >/dev/null)
+case "$stats" in
+  *'"tokens": 20,'*'"function_count": 2,'*'{"name": "main", "nodes": 2, "locals": 0, "insns": 13}'*) echo "--stats=json => OK" ;;
+  *) echo "--stats=json => unexpected output: $stats"; exit 1 ;;
+esac
+
+assert_obj 21 'main() { return 5+20-4; }'
+assert_obj 55 'main() { i=0; j=0; for (i=0; i<=10; i=i+1) j=i+j; return j; }'
+assert_obj 8 'main() { return ret3()+add(1,4); }'
+assert_obj 8 'main() { return add2(3,5); } add2(x,y) { return x+y; }'
+assert_obj 34 'main() { x=100000; y=99966; return x-y; }'
+
+assert_run 42 'main() { return 42; }'
+assert_run 55 'main() { i=0; j=0; for (i=0; i<=10; i=i+1) j=i+j; return j; }'
+assert_run 17 'main() { n=25; return fib(n); } fib(n) { if (n<2) return n; return fib(n-1)+fib(n-2); }'
+assert_run 5 'main() { x=3; y=&x; *y=5; return x; }'
+assert_run 7 'main() { x=3; y=5; *(&x-8)=7; return y; }'
+assert_run 6 'main() { a=1; return a + (a=5); }'
+
+if [ "$(uname -m)" = x86_64 ]; then
+  assert_run 42 'main() { return 42; }' --jit
+  assert_run 55 'main() { i=0; j=0; for (i=0; i<=10; i=i+1) j=i+j; return j; }' --jit
+  assert_run 17 'main() { n=25; return fib(n); } fib(n) { if (n<2) return n; return fib(n-1)+fib(n-2); }' --jit
+  assert_run 5 'main() { x=3; y=&x; *y=5; return x; }' --jit
+  assert_run 108 'main() { return h(1,2,3,4,5,6); } h(a,b,c,d,e,f) { return a*100+b*10+c-d-e-f; }' --jit
+  assert_run 255 'main() { x=0-7; return d(x,2)+d(x,0)+d(0-2,0-1); } d(a,b) { return a/b; }' --jit
+fi
+
 echo OK
@@ -1,29 +1,85 @@
 #include "9cc.h"
+#include <pthread.h>
+#include <stdatomic.h>
 
-char *user_input;
-Token *token;
+_Thread_local char *filename;
+
+// names the input in error messages when it is not a file, such as a
+// program of a batch. unlike filename, it gets no line info.
+_Thread_local char *input_label;
+_Thread_local char *user_input;
+_Thread_local Token *token;
+
+// line being tokenized, kept between calls of tokenize_function()
+_Thread_local int cur_line;
+_Thread_local char *cur_line_start;
+
+// when set, errors jump here instead of exiting
+_Thread_local jmp_buf *error_jmp;
+
+void error_exit()
+{
+    if (error_jmp)
+    {
+        longjmp(*error_jmp, 1);
+    }
+    exit(1);
+}
 
 // error report function
 void error(char *fmt, ...)
 {
     va_list ap;
     va_start(ap, fmt);
+    flockfile(stderr);
     vfprintf(stderr, fmt, ap);
     fprintf(stderr, "\n");
-    exit(1);
+    funlockfile(stderr);
+    error_exit();
 }
 
-// report where error occuers
+// report where error occuers.
+// only the line containing the error is printed since the input
+// may be a large file.
 void verror_at(char *loc, char *fmt, va_list ap)
 {
+    char *line = loc;
+    while (user_input < line && line[-1] != '\n')
+    {
+        line--;
+    }
+    char *end = loc;
+    while (*end && *end != '\n')
+    {
+        end++;
+    }
+
+    // keep the lines of a message together when files
+    // are compiled in parallel
+    flockfile(stderr);
+    int indent = 0;
+    char *name = filename ? filename : input_label;
+    if (name)
+    {
+        int lineno = 1;
+        for (char *p = user_input; p < line; p++)
+        {
+            if (*p == '\n')
+            {
+                lineno++;
+            }
+        }
+        indent = fprintf(stderr, "%s:%d: ", name, lineno);
+    }
 
-    int pos = loc - user_input;
-    fprintf(stderr, "%s\n", user_input);
+    int pos = loc - line + indent;
+    fprintf(stderr, "%.*s\n", (int)(end - line), line);
     fprintf(stderr, "%*s", pos, " ");
     fprintf(stderr, "^ ");
     vfprintf(stderr, fmt, ap);
     fprintf(stderr, "\n");
-    exit(1);
+    funlockfile(stderr);
+    error_exit();
 }
 
 // Reports an error location and exit.
@@ -42,17 +98,11 @@ void error_tok(Token *tok, char *fmt, ...)
     if (tok)
         verror_at(tok->str, fmt, ap);
 
+    flockfile(stderr);
     vfprintf(stderr, fmt, ap);
     fprintf(stderr, "\n");
-    exit(1);
-}
-
-char *strndup(char *p, int len)
-{
-    char *buf = malloc(len + 1);
-    strncpy(buf, p, len);
-    buf[len] = '\0';
-    return buf;
+    funlockfile(stderr);
+    error_exit();
 }
 
 // if the next token is the specified symbol,
@@ -111,16 +161,157 @@ int expect_number()
     return val;
 }
 
-char *expect_ident()
+int expect_ident()
 {
     if (token->kind != TK_IDENT)
     {
         error_tok(token, "expected an identifier");
     }
 
-    char *s = strndup(token->str, token->len);
+    int id = token->id;
     token = token->next;
-    return s;
+    return id;
+}
+
+// Identifiers are interned as they are tokenized. Each distinct name
+// is stored once and gets a small integer id, so names are compared by
+// id from then on. The names are kept in chunks that never move, so
+// they can be read without locking. New names are added to a table
+// shared by all threads under a lock, and each thread caches the names
+// it has seen, so that repeated identifiers do not take the lock.
+//
+// The names live as long as the process, even across the programs of
+// --batch. Ids outlive a single program: the entries of --profile-use
+// are interned once at startup and looked up by id in every program.
+// The table only grows with the number of distinct names, which
+// programs of a batch mostly share.
+
+#define IDENT_CHUNK 4096 // names per chunk
+#define IDENT_CHUNKS 65536
+
+// hash table of interned names
+typedef struct IdentTable IdentTable;
+struct IdentTable
+{
+    int *slots; // id + 1, or 0 if empty
+    int cap;    // number of slots, a power of two
+    int count;
+};
+
+_Atomic(_Atomic(char *) *) ident_chunks[IDENT_CHUNKS];
+atomic_int ident_count;
+pthread_mutex_t ident_lock = PTHREAD_MUTEX_INITIALIZER;
+IdentTable ident_table;                // guarded by ident_lock
+_Thread_local IdentTable local_idents; // names this thread has seen
+
+unsigned int hash_ident(char *str, int len)
+{
+    // FNV-1a
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < len; i++)
+    {
+        h = (h ^ (unsigned char)str[i]) * 16777619u;
+    }
+    return h;
+}
+
+int *find_ident_slot(IdentTable *t, char *str, int len)
+{
+    for (unsigned int i = hash_ident(str, len);; i++)
+    {
+        int *slot = &t->slots[i & (t->cap - 1)];
+        if (!*slot)
+        {
+            return slot;
+        }
+        char *name = ident_name(*slot - 1);
+        if (!strncmp(name, str, len) && !name[len])
+        {
+            return slot;
+        }
+    }
+}
+
+// returns the slot of str in t, growing t so that it stays at most
+// half full
+int *find_or_add_ident_slot(IdentTable *t, char *str, int len)
+{
+    if (t->count >= t->cap / 2)
+    {
+        int *old = t->slots;
+        int old_cap = t->cap;
+        t->cap = t->cap ? t->cap * 2 : 1024;
+        t->slots = calloc(t->cap, sizeof(int));
+        for (int i = 0; i < old_cap; i++)
+        {
+            if (old[i])
+            {
+                char *name = ident_name(old[i] - 1);
+                *find_ident_slot(t, name, strlen(name)) = old[i];
+            }
+        }
+        free(old);
+    }
+    return find_ident_slot(t, str, len);
+}
+
+// returns the id of the identifier str[0..len)
+int intern(char *str, int len)
+{
+    int *local = find_or_add_ident_slot(&local_idents, str, len);
+    if (*local)
+    {
+        return *local - 1;
+    }
+
+    pthread_mutex_lock(&ident_lock);
+    int *slot = find_or_add_ident_slot(&ident_table, str, len);
+    if (!*slot)
+    {
+        int id = atomic_load(&ident_count);
+        if (id == IDENT_CHUNK * IDENT_CHUNKS)
+        {
+            pthread_mutex_unlock(&ident_lock);
+            error("too many identifiers");
+        }
+        _Atomic(char *) *chunk = atomic_load(&ident_chunks[id / IDENT_CHUNK]);
+        if (!chunk)
+        {
+            chunk = calloc(IDENT_CHUNK, sizeof(*chunk));
+            atomic_store(&ident_chunks[id / IDENT_CHUNK], chunk);
+        }
+        atomic_store(&chunk[id % IDENT_CHUNK], strndup(str, len));
+        atomic_store(&ident_count, id + 1);
+        ident_table.count++;
+        *slot = id + 1;
+    }
+    int id = *slot - 1;
+    pthread_mutex_unlock(&ident_lock);
+
+    *local = id + 1;
+    local_idents.count++;
+    return id;
+}
+
+// frees the cache of the calling thread. threads call it before they
+// exit, since thread-local storage is not freed with the thread.
+void free_local_idents()
+{
+    free(local_idents.slots);
+    local_idents = (IdentTable){0};
+}
+
+// returns the number of identifiers interned so far. ids are below it.
+int num_idents()
+{
+    return atomic_load(&ident_count);
+}
+
+// returns the name of an interned identifier. the string lives as
+// long as the program.
+char *ident_name(int id)
+{
+    return atomic_load(&atomic_load(&ident_chunks[id / IDENT_CHUNK])[id % IDENT_CHUNK]);
 }
 
 bool at_eof()
@@ -140,6 +331,8 @@ Token *new_token(TokenKind kind, Token *cur, char *str, int len)
     tok->kind = kind;
     tok->str = str;
     tok->len = len;
+    tok->line = cur_line;
+    tok->col = str - cur_line_start + 1;
     cur->next = tok;
     return tok;
 }
@@ -180,19 +373,24 @@ char *starts_withreserved(char *p)
     return NULL;
 }
 
-// tokenize the input string 'input char' and return the start token
-Token *tokenize()
+// tokenizes the input from p. with one_function, stops after the "}"
+// that closes a top-level function and stores where it stopped in rest.
+Token *tokenize_from(char *p, bool one_function, char **rest)
 {
     Token head;
     head.next = NULL;
     Token *cur = &head;
-    char *p = user_input;
+    int depth = 0;
     while (*p)
     {
         // skip the space character
         if (isspace(*p))
         {
-            p++;
+            if (*p++ == '\n')
+            {
+                cur_line++;
+                cur_line_start = p;
+            }
             continue;
         }
 
@@ -208,6 +406,15 @@ Token *tokenize()
 
         if (strchr("+-*/()<>;={},&", *p))
         {
+            if (*p == '{')
+            {
+                depth++;
+            }
+            else if (*p == '}' && --depth == 0 && one_function)
+            {
+                cur = new_token(TK_RESERVED, cur, p++, 1);
+                break;
+            }
             cur = new_token(TK_RESERVED, cur, p++, 1);
             continue;
         }
@@ -221,6 +428,7 @@ Token *tokenize()
                 p++;
             }
             cur = new_token(TK_IDENT, cur, q, p - q);
+            cur->id = intern(q, p - q);
             continue;
         }
 
@@ -231,9 +439,45 @@ Token *tokenize()
             continue;
         }
 
-        error("failed to tokenize");
+        error_at(p, "invalid token");
     }
 
     new_token(TK_EOF, cur, p, 0);
+    if (rest)
+    {
+        *rest = p;
+    }
     return head.next;
 }
+
+// tokenize the input string 'input char' and return the start token
+Token *tokenize()
+{
+    cur_line = 1;
+    cur_line_start = user_input;
+    return tokenize_from(user_input, false, NULL);
+}
+
+// tokenizes the next function of the input starting at p,
+// so that a file can be compiled one function at a time.
+// line numbers continue from the previous call unless p is
+// the start of the input.
+Token *tokenize_function(char *p, char **rest)
+{
+    if (p == user_input)
+    {
+        cur_line = 1;
+        cur_line_start = user_input;
+    }
+    return tokenize_from(p, true, rest);
+}
+
+void free_tokens(Token *tok)
+{
+    while (tok)
+    {
+        Token *next = tok->next;
+        free(tok);
+        tok = next;
+    }
+}
@@ -0,0 +1,453 @@
+#include "9cc.h"
+#include <sys/mman.h>
+
+// x86-64 JIT backend.
+//
+// Machine code of each function is written into its own buffer, and
+// the buffers are copied to executable memory once every function has
+// been generated. The stack machine
+// stack is the hardware stack with 8-byte slots. Unlike the AArch64
+// backend, the depth of the stack is tracked at compile time so that
+// calls can keep rsp 16-byte aligned.
+
+typedef struct JitFixup JitFixup;
+struct JitFixup
+{
+    JitFixup *next;
+    int pos;   // offset of the rel32 field
+    int label; // label index, or -1 for the function epilogue
+};
+
+// state of the function being generated
+_Thread_local unsigned char *jit_buf;
+_Thread_local int jit_len;
+_Thread_local int jit_cap;
+_Thread_local int jit_depth;
+_Thread_local CallSite *jit_calls;
+
+// labels of the current function, indexed by seq * NUM_LABEL_KINDS + kind
+_Thread_local int *jit_labels;
+_Thread_local int jit_nlabels;
+_Thread_local JitFixup *jit_jumps;
+
+void *jit_main;
+
+// registers for the first six arguments, as the reg field of ModRM
+int jit_argreg[] = {7, 6, 2, 1, 0, 1}; // rdi, rsi, rdx, rcx, r8, r9
+
+void emit_code(char *code, int len)
+{
+    if (jit_cap < jit_len + len)
+    {
+        jit_cap = jit_cap ? jit_cap * 2 : 4096;
+        while (jit_cap < jit_len + len)
+        {
+            jit_cap *= 2;
+        }
+        jit_buf = realloc(jit_buf, jit_cap);
+    }
+    memcpy(jit_buf + jit_len, code, len);
+    jit_len += len;
+}
+
+#define EMIT(code) emit_code(code, sizeof(code) - 1)
+
+void emit32(int val)
+{
+    emit_code((char *)&val, 4);
+}
+
+void emit64(long val)
+{
+    emit_code((char *)&val, 8);
+}
+
+void patch32(int pos, int val)
+{
+    memcpy(jit_buf + pos, &val, 4);
+}
+
+// emits a rel32 placeholder to be resolved by the epilogue
+void emit_fixup(int label)
+{
+    JitFixup *fx = calloc(1, sizeof(JitFixup));
+    fx->pos = jit_len;
+    fx->label = label;
+    fx->next = jit_jumps;
+    jit_jumps = fx;
+    emit32(0);
+}
+
+void jit_push()
+{
+    EMIT("\x50"); // push rax
+    jit_depth++;
+}
+
+int label_index(LabelKind kind, int seq)
+{
+    int idx = seq * NUM_LABEL_KINDS + kind;
+    if (jit_nlabels <= idx)
+    {
+        int n = (idx + 1) * 2;
+        jit_labels = realloc(jit_labels, n * sizeof(int));
+        for (int i = jit_nlabels; i < n; i++)
+        {
+            jit_labels[i] = -1;
+        }
+        jit_nlabels = n;
+    }
+    return idx;
+}
+
+void x64_begin(Function *prog)
+{
+    jit_main = NULL;
+}
+
+// joins the code of the functions in executable memory
+// after resolving the calls between them.
+void x64_end(Function *prog, FILE *out)
+{
+    // offset of each function in the code, indexed by interned name,
+    // or -1 if it is not defined. the first definition wins, as in
+    // find_func().
+    int nids = num_idents();
+    int *offsets = malloc((nids + 1) * sizeof(int));
+    for (int i = 0; i <= nids; i++)
+    {
+        offsets[i] = -1;
+    }
+    int len = 0;
+    for (Function *fn = prog; fn; fn = fn->next)
+    {
+        if (offsets[fn->id] < 0)
+        {
+            offsets[fn->id] = len;
+        }
+        len += fn->code_len;
+    }
+
+    size_t size = len ? len : 1;
+    unsigned char *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+    {
+        error("mmap failed");
+    }
+
+    int pos = 0;
+    for (Function *fn = prog; fn; fn = fn->next)
+    {
+        memcpy(mem + pos, fn->code, fn->code_len);
+
+        for (CallSite *cs = fn->calls; cs; cs = cs->next)
+        {
+            if (offsets[cs->id] < 0)
+            {
+                error("undefined function: %s", cs->name);
+            }
+            int offset = pos + cs->offset;
+            int rel = offsets[cs->id] - (offset + 4);
+            memcpy(mem + offset, &rel, 4);
+        }
+        pos += fn->code_len;
+    }
+
+    if (mprotect(mem, size, PROT_READ | PROT_EXEC))
+    {
+        error("mprotect failed");
+    }
+
+    // "main" may be interned only now, if the program never names it
+    int main_id = intern("main", 4);
+    if (main_id < nids && offsets[main_id] >= 0)
+    {
+        jit_main = mem + offsets[main_id];
+    }
+    free(offsets);
+}
+
+void x64_prologue(Function *fn)
+{
+    jit_buf = NULL;
+    jit_len = 0;
+    jit_cap = 0;
+    jit_calls = NULL;
+    jit_depth = 0;
+    jit_jumps = NULL;
+    for (int i = 0; i < jit_nlabels; i++)
+    {
+        jit_labels[i] = -1;
+    }
+
+    EMIT("\x55");             // push rbp
+    EMIT("\x48\x89\xe5");     // mov rbp, rsp
+    EMIT("\x48\x81\xec");     // sub rsp, imm32
+    emit32(fn->stack_size);
+
+    // mov [rbp - offset], argreg
+    int i = 0;
+    for (VarList *vl = fn->params; vl; vl = vl->next)
+    {
+        if (i == 6)
+        {
+            error("%s: too many parameters", fn->name);
+        }
+        unsigned char insn[] = {i < 4 ? 0x48 : 0x4c, 0x89, 0x80 | jit_argreg[i] << 3 | 5};
+        emit_code((char *)insn, 3);
+        emit32(-vl->var->offset);
+        i++;
+    }
+}
+
+void x64_epilogue(Function *fn)
+{
+    int ret = jit_len;
+    EMIT("\x48\x89\xec"); // mov rsp, rbp
+    EMIT("\x5d");         // pop rbp
+    EMIT("\xc3");         // ret
+
+    for (JitFixup *fx = jit_jumps; fx; fx = fx->next)
+    {
+        int target = fx->label == -1 ? ret : jit_labels[fx->label];
+        patch32(fx->pos, target - (fx->pos + 4));
+    }
+
+    fn->code = (char *)jit_buf;
+    fn->code_len = jit_len;
+    fn->calls = jit_calls;
+}
+
+void x64_push_imm(long val)
+{
+    if (INT_MIN <= val && val <= INT_MAX)
+    {
+        EMIT("\x68"); // push imm32
+        emit32(val);
+        jit_depth++;
+        return;
+    }
+    EMIT("\x48\xb8"); // mov rax, imm64
+    emit64(val);
+    jit_push();
+}
+
+void x64_push_var_addr(Var *var)
+{
+    EMIT("\x48\x8d\x85"); // lea rax, [rbp - offset]
+    emit32(-var->offset);
+    jit_push();
+}
+
+void x64_pop()
+{
+    EMIT("\x48\x83\xc4\x08"); // add rsp, 8
+    jit_depth--;
+}
+
+// statements leave nothing on the stack, so there is
+// normally nothing to move into rax.
+void x64_pop_result()
+{
+    if (jit_depth > 0)
+    {
+        EMIT("\x58"); // pop rax
+        jit_depth--;
+    }
+}
+
+void x64_load()
+{
+    EMIT("\x58");         // pop rax
+    EMIT("\x48\x8b\x00"); // mov rax, [rax]
+    EMIT("\x50");         // push rax
+}
+
+void x64_store()
+{
+    EMIT("\x5f");         // pop rdi
+    EMIT("\x58");         // pop rax
+    EMIT("\x48\x89\x38"); // mov [rax], rdi
+    EMIT("\x57");         // push rdi
+    jit_depth--;
+}
+
+void x64_binop(NodeKind kind)
+{
+    EMIT("\x5f"); // pop rdi
+    EMIT("\x58"); // pop rax
+
+    switch (kind)
+    {
+    case ND_ADD:
+        EMIT("\x48\x01\xf8"); // add rax, rdi
+        break;
+    case ND_SUB:
+        EMIT("\x48\x29\xf8"); // sub rax, rdi
+        break;
+    case ND_MUL:
+        EMIT("\x48\x0f\xaf\xc7"); // imul rax, rdi
+        break;
+    case ND_DIV:
+        // idiv traps where sdiv does not: x/0 is 0 and
+        // INT64_MIN/-1 wraps around.
+        EMIT("\x48\x85\xff"     // test rdi, rdi
+             "\x74\x12"         // jz .zero
+             "\x48\x83\xff\xff" // cmp rdi, -1
+             "\x74\x07"         // je .neg
+             "\x48\x99"         // cqo
+             "\x48\xf7\xff"     // idiv rdi
+             "\xeb\x07"         // jmp .done
+             "\x48\xf7\xd8"     // .neg: neg rax
+             "\xeb\x02"         // jmp .done
+             "\x31\xc0");       // .zero: xor eax, eax
+        break;
+    case ND_EQ:
+        EMIT("\x48\x39\xf8\x0f\x94\xc0\x0f\xb6\xc0"); // cmp rax, rdi; sete al; movzx eax, al
+        break;
+    case ND_NE:
+        EMIT("\x48\x39\xf8\x0f\x95\xc0\x0f\xb6\xc0"); // cmp rax, rdi; setne al; movzx eax, al
+        break;
+    case ND_LT:
+        EMIT("\x48\x39\xf8\x0f\x9c\xc0\x0f\xb6\xc0"); // cmp rax, rdi; setl al; movzx eax, al
+        break;
+    case ND_LE:
+        EMIT("\x48\x39\xf8\x0f\x9e\xc0\x0f\xb6\xc0"); // cmp rax, rdi; setle al; movzx eax, al
+        break;
+    }
+
+    EMIT("\x50"); // push rax
+    jit_depth--;
+}
+
+void x64_funcall(int id, int nargs)
+{
+    char *name = ident_name(id);
+    if (nargs > 6)
+    {
+        error("%s: too many arguments", name);
+    }
+
+    // pop rdi, rsi, rdx, rcx, r8, r9
+    static char *pops[] = {"\x5f", "\x5e", "\x5a", "\x59", "\x41\x58", "\x41\x59"};
+    for (int i = nargs - 1; i >= 0; i--)
+    {
+        emit_code(pops[i], strlen(pops[i]));
+        jit_depth--;
+    }
+
+    bool pad = jit_depth % 2;
+    if (pad)
+    {
+        EMIT("\x48\x83\xec\x08"); // sub rsp, 8
+    }
+
+    int bi = find_builtin(name);
+    if (bi != -1)
+    {
+        // builtins take their arguments as an array
+        EMIT("\x48\x83\xec\x30"); // sub rsp, 48
+        for (int i = 0; i < nargs; i++)
+        {
+            // mov [rsp + 8 * i], argreg
+            unsigned char insn[] = {i < 4 ? 0x48 : 0x4c, 0x89, 0x44 | jit_argreg[i] << 3, 0x24, 8 * i};
+            emit_code((char *)insn, 5);
+        }
+        EMIT("\x48\x89\xe7"); // mov rdi, rsp
+        EMIT("\x48\xb8");     // mov rax, imm64
+        emit64((long)builtins[bi].fn);
+        EMIT("\xff\xd0");         // call rax
+        EMIT("\x48\x83\xc4\x30"); // add rsp, 48
+    }
+    else
+    {
+        EMIT("\xe8"); // call rel32
+        CallSite *cs = calloc(1, sizeof(CallSite));
+        cs->offset = jit_len;
+        cs->id = id;
+        cs->name = name;
+        cs->next = jit_calls;
+        jit_calls = cs;
+        emit32(0);
+    }
+
+    if (pad)
+    {
+        EMIT("\x48\x83\xc4\x08"); // add rsp, 8
+    }
+    jit_push();
+}
+
+void x64_ret()
+{
+    EMIT("\x58"); // pop rax
+    jit_depth--;
+    EMIT("\xe9"); // jmp epilogue
+    emit_fixup(-1);
+}
+
+void x64_branch_zero(LabelKind kind, int seq)
+{
+    EMIT("\x58");         // pop rax
+    EMIT("\x48\x85\xc0"); // test rax, rax
+    EMIT("\x0f\x84");     // jz rel32
+    emit_fixup(label_index(kind, seq));
+    jit_depth--;
+}
+
+void x64_branch_nonzero(LabelKind kind, int seq)
+{
+    EMIT("\x58");         // pop rax
+    EMIT("\x48\x85\xc0"); // test rax, rax
+    EMIT("\x0f\x85");     // jnz rel32
+    emit_fixup(label_index(kind, seq));
+    jit_depth--;
+}
+
+void x64_jump(LabelKind kind, int seq)
+{
+    EMIT("\xe9"); // jmp rel32
+    emit_fixup(label_index(kind, seq));
+}
+
+void x64_label(LabelKind kind, int seq)
+{
+    int idx = label_index(kind, seq);
+    jit_labels[idx] = jit_len;
+}
+
+Backend x86_64_jit_backend = {
+    .begin = x64_begin,
+    .end = x64_end,
+    .prologue = x64_prologue,
+    .epilogue = x64_epilogue,
+    .push_imm = x64_push_imm,
+    .push_var_addr = x64_push_var_addr,
+    .pop = x64_pop,
+    .pop_result = x64_pop_result,
+    .load = x64_load,
+    .store = x64_store,
+    .binop = x64_binop,
+    .funcall = x64_funcall,
+    .ret = x64_ret,
+    .branch_zero = x64_branch_zero,
+    .branch_nonzero = x64_branch_nonzero,
+    .jump = x64_jump,
+    .label = x64_label,
+};
+
+// calls main() of the code generated by the JIT backend.
+long jit_run()
+{
+#ifdef __x86_64__
+    if (!jit_main)
+    {
+        error("main is not defined");
+    }
+    long ret = ((long (*)())jit_main)();
+    fflush(stdout);
+    return ret;
+#else
+    error("--jit requires an x86-64 host");
+#endif
+}